@@ -23,9 +23,139 @@
 #include "config.h"
 #include "errors.h"
 #include "lcd.h"
+#include "fastpin.h"
+#include "filter.h"
+
+// Pins used in ads1231_read_raw(), see fastpin.h
+#ifdef ADS1231_FAST_IO
+typedef FastPin<ADS1231_DATA_PIN>   ads1231_data_pin;
+typedef FastPin<ADS1231_CLK_PIN>    ads1231_clk_pin;
+#else
+typedef ArduinoPin<ADS1231_DATA_PIN> ads1231_data_pin;
+typedef ArduinoPin<ADS1231_CLK_PIN>  ads1231_clk_pin;
+#endif
+
+weight_t ads1231_offset = 0;
+// ads1231_offset after the last tare, auto zero stays close to it
+static weight_t ads1231_tared_offset = 0;
+// ads1231_offset as stored in EEPROM
+static weight_t ads1231_saved_offset = 0;
+// last time ads1231_auto_zero() corrected the offset
+static unsigned long ads1231_auto_zero_millis = 0;
 
-unsigned long ads1231_last_millis = 0;
-int ads1231_offset = 0;
+/*
+ * Samples captured by ads1231_drdy_isr(). The ring is lock-free: the ISR is
+ * the only writer and publishes a sample by incrementing ads1231_count
+ * *after* the slot has been filled. ads1231_count is a single byte, so
+ * reading it is atomic on AVR. Slot i lives at ads1231_ring[i % SIZE],
+ * which works across the unsigned char overflow because
+ * ADS1231_RING_SIZE divides 256.
+ */
+static volatile ads1231_sample ads1231_ring[ADS1231_RING_SIZE];
+static volatile unsigned char ads1231_count = 0;
+// current state of the SPEED pin, see ads1231_set_speed()
+static bool ads1231_fast = false;
+// Samples captured before this time are discarded because the digital filter
+// of the ADS1231 has not settled yet. Only written with interrupts disabled.
+static volatile unsigned long ads1231_settled_millis = 0;
+
+/*
+ * Samples are converted to weights and passed through a filter chain (see
+ * filter.h) by ads1231_update(). The filter parameters depend on the mode.
+ */
+static const filter_params ads1231_presets[] = {
+    FILTER_PRESET_IDLE,         // ADS1231_IDLE
+    FILTER_PRESET_SETTLING,     // ADS1231_SETTLING
+    FILTER_PRESET_POURING,      // ADS1231_POURING
+};
+static unsigned char ads1231_mode = ADS1231_IDLE;
+static filter ads1231_filter;
+static bool ads1231_filter_initialized = false;
+// ads1231_count of the next sample to be filtered
+static unsigned char ads1231_filtered_count = 0;
+// number of samples which passed filter_gate(), increases by one per sample
+static unsigned char ads1231_accepted_count = 0;
+// ads1231_accepted_count at the last call of ads1231_get_noblock()
+static unsigned char ads1231_noblock_count = 0;
+// newest filtered weight and the time the last sample was captured (also
+// if it was rejected by filter_gate())
+static weight_t ads1231_weight = 0;
+static unsigned long ads1231_weight_millis = 0;
+// time of the last servo step, see ads1231_note_motion()
+static unsigned long ads1231_motion_millis = 0;
+
+// Filtered weights of the last accepted samples, used to detect a stable
+// weight. Entry i lives at ads1231_history[i % ADS1231_HISTORY_SIZE].
+struct ads1231_point {
+    unsigned long millis;
+    weight_t weight;
+};
+static ads1231_point ads1231_history[ADS1231_HISTORY_SIZE];
+static unsigned char ads1231_history_count = 0;
+static unsigned char ads1231_history_len = 0; // valid entries
+// flow rate of the history, see ads1231_update_flow()
+static long ads1231_flow = 0;
+
+/*
+ * Clock out the 24 bit sample. Must only be called after DRDY went low.
+ */
+static long ads1231_read_raw(void)
+{
+    long val = 0;
+
+    // Read 24 bits. Data is valid 50ns after the rising edge of the clock,
+    // there are at least two cycles (125ns) until we read it.
+    for(int i=23 ; i >= 0; i--) {
+        ads1231_clk_pin::write(HIGH);
+        val = (val << 1) + ads1231_data_pin::read();
+        ads1231_clk_pin::write(LOW);
+    }
+
+    /* Bit 23 is acutally the sign bit. Shift by 8 to get it to the
+     * right position (31), divide by 256 to restore the correct value.
+     */
+    val = (val << 8) / 256;
+
+    /* The data pin now is high or low depending on the last bit that
+     * was read.
+     * To get it to the default state (high) we toggle the clock one
+     * more time (see datasheet page 14 figure 19).
+     */
+    ads1231_clk_pin::write(HIGH);
+    ads1231_clk_pin::write(LOW);
+
+    return val;
+}
+
+/*
+ * Interrupt handler for the HIGH to LOW transition on the data pin, which
+ * means that the ADS1231 has finished a measurement (see datasheet page 13).
+ *
+ * Reading the bits toggles the data pin, i.e. triggers this interrupt
+ * again. We therefore mask it while reading and clear the pending flag
+ * afterwards. Other interrupts are enabled while reading, otherwise the
+ * pulses of the Servo library would jitter.
+ */
+static void ads1231_drdy_isr(void)
+{
+    EIMSK &= ~bit(ADS1231_DRDY_INT);
+    interrupts();
+
+    long val = ads1231_read_raw();
+
+    noInterrupts();
+    EIFR = bit(ADS1231_DRDY_INT);
+    EIMSK |= bit(ADS1231_DRDY_INT);
+
+    if ((long)(millis() - ads1231_settled_millis) < 0)
+        return; // speed was changed recently, sample not settled yet
+
+    unsigned char count = ads1231_count;
+    volatile ads1231_sample& slot = ads1231_ring[count % ADS1231_RING_SIZE];
+    slot.millis = millis();
+    slot.raw = val;
+    ads1231_count = count + 1; // publish
+}
 
 /*
  * Initialize the interface pins
@@ -43,142 +173,393 @@ void ads1231_init(void)
     // Set CLK low to get the ADS1231 out of suspend
     digitalWrite(ADS1231_CLK_PIN, 0);
 
+    // Start with 10 samples per second
+    pinMode(ADS1231_SPEED_PIN, OUTPUT);
+    digitalWrite(ADS1231_SPEED_PIN, LOW);
+    ads1231_fast = false;
+
     // Read absolute offset from EPROM
     EEPROM_read(ADS1231_OFFSET_EEPROM_POS, ads1231_offset);
+    if (ads1231_offset == EEPROM_ERASED_LONG) {
+        // not tared since the offset is stored in centigrams
+        int offset_grams;
+        EEPROM_read(ADS1231_OFFSET_GRAMS_EEPROM_POS, offset_grams);
+        ads1231_offset = GRAMS(offset_grams);
+    }
+    ads1231_tared_offset = ads1231_offset;
+    ads1231_saved_offset = ads1231_offset;
+
+    // From now on the ADS1231 is read in the background
+    ads1231_settled_millis = millis()
+                             + ADS1231_SETTLING_SAMPLES * ads1231_sample_period();
+    attachInterrupt(digitalPinToInterrupt(ADS1231_DATA_PIN),
+            ads1231_drdy_isr, FALLING);
 }
 
 /*
- * Get the raw ADC value. Can block up to 100ms in normal operation.
- * Returns 0 on success, an error code otherwise (see ads1231.h)
+ * Switch between 10 (ADS1231_SLOW) and 80 (ADS1231_FAST) samples per second
+ * using the SPEED pin. Samples are discarded for ADS1231_SETTLING_SAMPLES
+ * sample periods after switching, until then the newest sample is the last
+ * one taken at the old speed.
  */
-errv_t ads1231_get_value(long& val)
+static void ads1231_set_speed(bool fast)
 {
-    int i=0;
-    unsigned long start;
-
-    /* A high to low transition on the data pin means that the ADS1231
-     * has finished a measurement (see datasheet page 13).
-     * This can take up to 100ms (the ADS1231 runs at 10 samples per
-     * second!).
-     * Note that just testing for the state of the pin is unsafe.
-     */
-    start=millis();
-    while(digitalRead(ADS1231_DATA_PIN) != HIGH)
-    {
-        if(millis() > start+150)
-            return ADS1231_TIMEOUT_HIGH; // Timeout waiting for HIGH
+    if (fast == ads1231_fast)
+        return;
+    digitalWrite(ADS1231_SPEED_PIN, fast ? HIGH : LOW);
+    ads1231_fast = fast;
+    unsigned long settled = millis()
+                            + ADS1231_SETTLING_SAMPLES * ads1231_sample_period();
+    noInterrupts();
+    ads1231_settled_millis = settled;
+    interrupts();
+}
+
+/*
+ * Milliseconds between two samples at the current speed (rounded up).
+ */
+unsigned int ads1231_sample_period(void)
+{
+    return ads1231_fast ? ADS1231_PERIOD_FAST : ADS1231_PERIOD_SLOW;
+}
+
+/*
+ * Milliseconds without a new sample until we report a timeout.
+ */
+static unsigned int ads1231_timeout(void)
+{
+    return ads1231_sample_period() * 3 / 2;
+}
+
+/*
+ * Wait for the first sample after ads1231_init(), returns immediately later
+ * on.
+ */
+static errv_t ads1231_wait_for_first_sample(void)
+{
+    while (ads1231_count == 0) {
+        if ((long)(millis() - ads1231_settled_millis) > (long)ads1231_timeout())
+            return ADS1231_TIMEOUT_LOW; // Never got a HIGH to LOW transition
     }
-    start=millis();
-    while(digitalRead(ADS1231_DATA_PIN) != LOW)
-    {
-        if(millis() > start+150)
-            return ADS1231_TIMEOUT_LOW; // Timeout waiting for LOW
+    return 0;
+}
+
+/*
+ * Returns ADS1231_TIMEOUT_LOW if there should be a newer sample than the one
+ * captured at sample_millis, 0 otherwise.
+ */
+static errv_t ads1231_check_timeout(unsigned long sample_millis)
+{
+    // There should be a new sample every ads1231_sample_period(), or right
+    // after settling if the speed was changed.
+    if ((long)(ads1231_settled_millis - sample_millis) > 0)
+        sample_millis = ads1231_settled_millis;
+    if ((long)(millis() - sample_millis) > (long)ads1231_timeout())
+        return ADS1231_TIMEOUT_LOW; // Timeout waiting for LOW
+    return 0;
+}
+
+/*
+ * Get the newest sample captured by the interrupt handler. Does not block
+ * except right after ads1231_init() when no sample has been captured yet.
+ * Returns 0 on success, an error code otherwise (see errors.h)
+ */
+errv_t ads1231_get_sample(ads1231_sample& sample)
+{
+    RETURN_IFN_0(ads1231_wait_for_first_sample());
+
+    // The ISR writes slot count, so slot count - 1 is not touched unless
+    // ADS1231_RING_SIZE - 1 samples arrive while copying. Impossible.
+    unsigned char count = ads1231_count;
+    volatile ads1231_sample& slot = ads1231_ring[(unsigned char)(count - 1)
+                                                  % ADS1231_RING_SIZE];
+    sample.millis = slot.millis;
+    sample.raw = slot.raw;
+
+    RETURN_IFN_0(ads1231_check_timeout(sample.millis));
+    return 0; // Success
+}
+
+/*
+ * Get the raw ADC value of the newest sample. Does not block.
+ * Returns 0 on success, an error code otherwise (see errors.h)
+ */
+errv_t ads1231_get_value(long& val)
+{
+    ads1231_sample sample;
+    val = 0;
+    RETURN_IFN_0(ads1231_get_sample(sample));
+    val = sample.raw;
+    return 0; // Success
+}
+
+/*
+ * Round a weight to whole grams, used for the serial protocol.
+ */
+int weight_to_grams(weight_t weight)
+{
+    if (weight >= 0)
+        return (weight + 50) / 100;
+    return (weight - 50) / 100;
+}
+
+/*
+ * Compute ads1231_flow from the history, called once per accepted sample by
+ * ads1231_update() so ads1231_get_flow() is cheap in the pouring loop.
+ */
+static void ads1231_update_flow(void)
+{
+    const ads1231_point& newest = ads1231_history[
+            (unsigned char)(ads1231_history_count - 1) % ADS1231_HISTORY_SIZE];
+    ads1231_flow = 0;
+
+    // Times and weights relative to the newest sample keep the sums small,
+    // the slope does not change.
+    long long sum_t = 0, sum_w = 0, sum_tt = 0, sum_tw = 0;
+    long n = 0;
+    for (unsigned char i = 0; i < ads1231_history_len; i++) {
+        const ads1231_point& p = ads1231_history[
+                (unsigned char)(ads1231_history_count - 1 - i) % ADS1231_HISTORY_SIZE];
+        long t = newest.millis - p.millis;
+        if (t > ADS1231_FLOW_WINDOW)
+            break;
+        long w = p.weight - newest.weight;
+        sum_t += t;
+        sum_w += w;
+        sum_tt += (long long)t * t;
+        sum_tw += (long long)t * w;
+        n++;
     }
-    ads1231_last_millis = millis();
+    if (n < 3)
+        return;
+
+    long long den = n * sum_tt - sum_t * sum_t;
+    if (den == 0)
+        return;
+    // t counts backwards, hence the minus
+    ads1231_flow = -1000 * (n * sum_tw - sum_t * sum_w) / den;
+}
 
-    // Read 24 bits
-    for(i=23 ; i >= 0; i--) {
-        digitalWrite(ADS1231_CLK_PIN, HIGH);
-        val = (val << 1) + digitalRead(ADS1231_DATA_PIN);
-        digitalWrite(ADS1231_CLK_PIN, LOW);
+/*
+ * Feed all samples captured since the last call through the filter chain.
+ * Called by every function returning a weight, so there is no need to call
+ * it regularly. But samples get lost if more than ADS1231_RING_SIZE - 1
+ * samples arrive in between.
+ */
+static void ads1231_update(void)
+{
+    unsigned char count = ads1231_count;
+    if ((unsigned char)(count - ads1231_filtered_count) > ADS1231_RING_SIZE - 1) {
+        // the oldest ones are overwritten already
+        ads1231_filtered_count = count - (ADS1231_RING_SIZE - 1);
     }
 
-    /* Bit 23 is acutally the sign bit. Shift by 8 to get it to the
-     * right position (31), divide by 256 to restore the correct value.
-     */
-    val = (val << 8) / 256;
+    while (ads1231_filtered_count != count) {
+        volatile ads1231_sample& slot = ads1231_ring[ads1231_filtered_count
+                                                      % ADS1231_RING_SIZE];
+        unsigned long sample_millis = slot.millis;
+        weight_t weight = ads1231_raw_to_weight(slot.raw, ads1231_offset);
 
-    /* The data pin now is high or low depending on the last bit that
-     * was read.
-     * To get it to the default state (high) we toggle the clock one
-     * more time (see datasheet page 14 figure 19).
-     */
-    digitalWrite(ADS1231_CLK_PIN, HIGH);
-    digitalWrite(ADS1231_CLK_PIN, LOW);
+        if (!ads1231_filter_initialized) {
+            filter_init(ads1231_filter, ads1231_presets[ads1231_mode], weight);
+            ads1231_filter_initialized = true;
+        }
+        ads1231_weight_millis = sample_millis;
+        ads1231_filtered_count++;
+
+        // Moving servos shake the frame, which causes spikes. Drop them
+        // before they reach the median filter and the stability checks.
+        weight_t max_step = 0;
+        if ((long)(sample_millis - ads1231_motion_millis) < ADS1231_MOTION_HOLDOFF)
+            max_step = ADS1231_MOTION_MAX_STEP;
+        if (!filter_gate(ads1231_filter, weight, max_step,
+                         ADS1231_MOTION_MAX_REJECTS))
+            continue;
 
-    return 0; // Success
+        ads1231_weight = filter_process(ads1231_filter, weight);
+        ads1231_accepted_count++;
+
+        ads1231_point& p = ads1231_history[ads1231_history_count
+                                           % ADS1231_HISTORY_SIZE];
+        p.millis = sample_millis;
+        p.weight = ads1231_weight;
+        ads1231_history_count++;
+        if (ads1231_history_len < ADS1231_HISTORY_SIZE)
+            ads1231_history_len++;
+        ads1231_update_flow();
+    }
 }
 
 /*
- * Get the weight in grams. Can block up to 100ms in normal
- * operation because the ADS1231 makes only 10 measurements per second.
- * Returns 0 on sucess, an error code otherwise (see errors.h)
+ * Tell the scale that a servo moved. For ADS1231_MOTION_HOLDOFF milliseconds
+ * afterwards samples are checked for spikes (see filter_gate()). Call it on
+ * every servo step.
+ */
+void ads1231_note_motion(void)
+{
+    ads1231_motion_millis = millis();
+}
+
+/*
+ * Set sample rate and filter preset:
+ *   ADS1231_IDLE       10 samples per second, FILTER_PRESET_IDLE
+ *   ADS1231_SETTLING   80 samples per second, FILTER_PRESET_SETTLING
+ *   ADS1231_POURING    80 samples per second, FILTER_PRESET_POURING
+ * The filter starts at the last filtered weight, so there is no jump.
+ */
+void ads1231_set_mode(unsigned char mode)
+{
+    if (mode == ads1231_mode)
+        return;
+    ads1231_update();
+    ads1231_mode = mode;
+    ads1231_set_speed(mode == ADS1231_IDLE ? ADS1231_SLOW : ADS1231_FAST);
+    if (ads1231_filter_initialized)
+        filter_init(ads1231_filter, ads1231_presets[mode], ads1231_weight);
+}
+
+/*
+ * Get the filtered weight (in centigrams) up to the newest sample. Does not
+ * block. Returns 0 on sucess, an error code otherwise (see errors.h)
  */
-errv_t ads1231_get_grams(int& grams)
+errv_t ads1231_get_weight(weight_t& weight)
 {
     // a primitive emulation using a potentiometer attached to pin A0
     // returns a value between 0 and 150 grams
     #ifdef ADS1231_EMULATION
-    grams = map(analogRead(A0) , 0, 1023, 0, 150);
+    weight = map(analogRead(A0) , 0, 1023, 0, GRAMS(150));
     return 0;
     #endif
 
-    int ret;
-    long raw;
-    grams=0; // On error, grams should always be zero
+    weight=0; // On error, weight should always be zero
 
-    ret = ads1231_get_value(raw);
-    if(ret != 0)
-        return ret; // Scale error
+    RETURN_IFN_0(ads1231_wait_for_first_sample());
+    ads1231_update();
+    RETURN_IFN_0(ads1231_check_timeout(ads1231_weight_millis));
 
-    grams = raw/ADS1231_DIVISOR + ads1231_offset;
+    weight = ads1231_weight;
     return 0; // Success
 }
 
 
 /*
- * Get the weight in grams but measure often until the same weight is measured
- * for 3 three times.
- * Can block for longer if the weight on scale is not stable. Something similar
- * is implemented in Bottle::turn_to() (see parameter 'stable_weight') in order
+ * Stability detector, shared by ads1231_get_stable_weight() and
+ * Bottle::turn_to(). Looks back from the newest accepted sample for how long
+ * all samples stayed within a range of ADS1231_STABLE_EPSILON. 'confidence'
+ * is that time in percent of ADS1231_STABLE_WINDOW (max. 100). The weight is
+ * stable if confidence is 100, 'weight' is the mean of these samples then
+ * (the newest filtered weight if there is no history yet).
+ *
+ * Returns 0 on success, an error code otherwise (see errors.h)
+ */
+errv_t ads1231_get_stability(weight_t& weight, unsigned char& confidence)
+{
+    confidence = 0;
+    RETURN_IFN_0(ads1231_get_weight(weight));
+
+    weight_t lo = weight, hi = weight;
+    long sum = 0;
+    unsigned char n = 0;
+    unsigned long span = 0;
+    for (unsigned char i = 0; i < ads1231_history_len; i++) {
+        const ads1231_point& p = ads1231_history[
+                (unsigned char)(ads1231_history_count - 1 - i) % ADS1231_HISTORY_SIZE];
+        lo = min(lo, p.weight);
+        hi = max(hi, p.weight);
+        if (hi - lo > ADS1231_STABLE_EPSILON)
+            break;
+        sum += p.weight;
+        n++;
+        span = ads1231_weight_millis - p.millis;
+        if (span >= ADS1231_STABLE_WINDOW)
+            break;
+    }
+
+    if (n > 0)
+        weight = sum / n;
+    confidence = min(100, 100 * span / ADS1231_STABLE_WINDOW);
+    return 0;
+}
+
+
+/*
+ * Flow rate estimator: least squares slope of the filtered weights within
+ * the last ADS1231_FLOW_WINDOW milliseconds, in centigrams per second (see
+ * ads1231_update_flow()). 'flow' is 0 if there are less than three samples
+ * within the window.
+ *
+ * Returns 0 on success, an error code otherwise (see errors.h)
+ */
+errv_t ads1231_get_flow(long& flow)
+{
+    flow = 0;
+    weight_t weight;
+    RETURN_IFN_0(ads1231_get_weight(weight));
+    flow = ads1231_flow;
+    return 0;
+}
+
+
+/*
+ * Get the weight but wait until it is stable (see ads1231_get_stability()).
+ * Can block up to ADS1231_STABLE_MILLIS if the weight on scale is not stable.
+ * Bottle::turn_to() (see parameter 'stable_weight') uses the same detector
  * to get a stable weight without blocking the movement of the bottle.
  *
  * Returns 0 on sucess, an error code otherwise (see errors.h)
  */
-errv_t ads1231_get_stable_grams(int& grams) {
-    grams = 0; // needs to be 0 on error
-    int i = 0;
+errv_t ads1231_get_stable_weight(weight_t& stable_weight) {
+    stable_weight = 0; // needs to be 0 on error
     unsigned long start = millis();
-    int weight_last, weight;
-    RETURN_IFN_0(ads1231_get_grams(weight));
-    while (i < 2) {
-        delay(100); // TODO make this a constant in config.h
-        weight_last = weight;
-        RETURN_IFN_0(ads1231_get_grams(weight));
-        // TODO maybe this would be more correct...? do we have abs?
-        //if (abs((weight_last - weight) < WEIGHT_EPSILON)
-        if (weight_last == weight) {
-            // weight stable
-            i++;
-        } else {
-            // weight not stable
-            i = 0;
-        }
-        DEBUG_START();
-        DEBUG_MSG("Not stable: ");
-        DEBUG_VAL(weight);
-        DEBUG_VAL(weight_last);
-        DEBUG_END();
+    weight_t weight;
+    unsigned char confidence;
+    while (1) {
+        RETURN_IFN_0(ads1231_get_stability(weight, confidence));
+        if (confidence == 100)
+            break;
 
         if (millis() - start > ADS1231_STABLE_MILLIS) {
+            DEBUG_START();
+            DEBUG_MSG("Not stable: ");
+            DEBUG_VAL(weight);
+            DEBUG_VAL(confidence);
+            DEBUG_END();
             return ADS1231_STABLE_TIMEOUT;
         }
     }
-    grams = weight;
+    stable_weight = weight;
     return 0;
 }
 
 
+/*
+ * Add 'delta' to ads1231_offset. Filter state and history are shifted as
+ * well, so the next weights do not mix old and new offset.
+ */
+static void ads1231_add_offset(weight_t delta)
+{
+    ads1231_offset += delta;
+    ads1231_weight += delta;
+    filter_init(ads1231_filter, ads1231_presets[ads1231_mode], ads1231_weight);
+    for (unsigned char i = 0; i < ADS1231_HISTORY_SIZE; i++)
+        ads1231_history[i].weight += delta;
+}
+
 /**
  * Tare scale. Call this if there is nothing on scale to store offset and zero
  * current measured value.
  */
-errv_t ads1231_tare(int& grams) {
-    // get grams or return error immediately on error
-    RETURN_IFN_0( ads1231_get_stable_grams(grams) );
+errv_t ads1231_tare(weight_t& weight) {
+    // less noise at 10 samples per second
+    ads1231_set_mode(ADS1231_IDLE);
+
+    // get weight or return error immediately on error
+    RETURN_IFN_0( ads1231_get_stable_weight(weight) );
 
     // success
-    ads1231_offset += -grams;
+    ads1231_add_offset(-weight);
+    ads1231_tared_offset = ads1231_offset;
+    ads1231_saved_offset = ads1231_offset;
     EEPROM_write(ADS1231_OFFSET_EEPROM_POS, ads1231_offset);
 
     return 0;
@@ -186,17 +567,54 @@ errv_t ads1231_tare(int& grams) {
 
 
 /**
- * Get grams from scale if measurement fast enough, otherwise returns
- * with error ADS1231_WOULD_BLOCK. Should not block longer than 10ms.
+ * Track the zero point while idle, compensating the drift of the load cell.
+ * Call it often in idle mode, does not block. At most every
+ * AUTO_ZERO_INTERVAL milliseconds, if the weight is stable and closer than
+ * AUTO_ZERO_WINDOW to zero (i.e. no cup), the offset is moved by up to
+ * AUTO_ZERO_STEP towards zero. It never leaves the last tared offset by more
+ * than AUTO_ZERO_MAX. The offset is written to EEPROM only if it differs more
+ * than AUTO_ZERO_SAVE from the stored one.
+ */
+void ads1231_auto_zero(void) {
+    if (ads1231_mode != ADS1231_IDLE
+            || millis() - ads1231_auto_zero_millis < AUTO_ZERO_INTERVAL)
+        return;
+
+    weight_t weight;
+    unsigned char confidence;
+    if (ads1231_get_stability(weight, confidence) != 0 || confidence < 100
+            || abs(weight) > AUTO_ZERO_WINDOW)
+        return;
+    ads1231_auto_zero_millis = millis();
+
+    weight_t offset = ads1231_offset - constrain(weight, -AUTO_ZERO_STEP, AUTO_ZERO_STEP);
+    offset = constrain(offset, ads1231_tared_offset - AUTO_ZERO_MAX,
+                               ads1231_tared_offset + AUTO_ZERO_MAX);
+    if (offset == ads1231_offset)
+        return;
+    ads1231_add_offset(offset - ads1231_offset);
+
+    if (abs(ads1231_offset - ads1231_saved_offset) > AUTO_ZERO_SAVE) {
+        EEPROM_write(ADS1231_OFFSET_EEPROM_POS, ads1231_offset);
+        ads1231_saved_offset = ads1231_offset;
+        DEBUG_MSG_LN(String("Auto zero saved offset ") + String(ads1231_offset));
+    }
+}
+
+
+/**
+ * Get weight from scale if a new sample was filtered since the last call,
+ * otherwise returns with error ADS1231_WOULD_BLOCK. Samples rejected as
+ * spikes do not count. Never blocks. Used to compare consecutive samples, see
+ * Bottle::turn_to().
  */
-errv_t ads1231_get_noblock(int& grams) {
-     // ADS1231 supports 10 samples per second. That means after the last
-     // sample we need to wait 100ms. If 90ms passed already, it should be OK.
-    unsigned long t = (millis() - ads1231_last_millis) % 100;
-    if (t < 90) {
+errv_t ads1231_get_noblock(weight_t& weight) {
+    ads1231_update();
+    if (ads1231_accepted_count == ads1231_noblock_count) {
         return ADS1231_WOULD_BLOCK;
     }
-    return ads1231_get_grams(grams);
+    ads1231_noblock_count = ads1231_accepted_count;
+    return ads1231_get_weight(weight);
 }
 
 
@@ -207,19 +625,15 @@ errv_t ads1231_get_noblock(int& grams) {
  * weight might be current weight to detect any increase of weight.
  * If "reverse" is set to true, we wait until weight gets less than weight +
  * WEIGHT_EPSILON.
+ * For waiting while pouring see Bottle::wait_poured().
  * Return values:   see also errors.h!
  *  0 weight was reached (success)
- *  1 timeout (pouring too slow)
- *  2 bottle empty (weight did not change for BOTTLE_EMPTY_INTERVAL ms)
- *  3 cup removed (weight has decreased)
- *  other values: scale error (see ads1231.h).
+ *  1 timeout
+ *  other values: scale error (see ads1231.h) or ABORTED.
  */
-errv_t delay_until(long max_delay, int weight, bool pour_handling, bool reverse) {
+errv_t delay_until(long max_delay, weight_t weight, bool reverse) {
     unsigned long start = millis();
-    int cur, ret;
-    int last     = -999; // == -inf, because the first time checks should
-    int last_old = -999; // always pass until we have a valid last/last_old
-    unsigned long last_millis = 0;
+    weight_t cur;
 
     int one = 1;
     if (reverse) {
@@ -230,44 +644,14 @@ errv_t delay_until(long max_delay, int weight, bool pour_handling, bool reverse)
         if(max_delay > 0 && millis() - start > max_delay)
             return DELAY_UNTIL_TIMEOUT; // Timeout
 
-        // this blocks 100ms because ADS1231 runs at 10 samples per second
-        ret = ads1231_get_grams(cur);
-        if(ret != 0)
-            return ret; // Scale error
-
-        // this delays, we do not want it...
-        //DEBUG_VAL_LN(cur);
+        // does not block, the sample is captured in the background
+        RETURN_IFN_0(ads1231_get_weight(cur));
 
         RETURN_IFN_0(check_aborted());
 
         // "one" inverts the inequality
         if(cur * one > (weight + WEIGHT_EPSILON) * one)
             return 0;
-
-        // Just waiting for weight, no special pouring error detection
-        if (!pour_handling)
-            continue;
-
-        if(last > cur + WEIGHT_EPSILON || cur < WEIGHT_EPSILON)
-            return WHERE_THE_FUCK_IS_THE_CUP; // Current weight is smaller than last measured
-
-        // Jakob does not like abs, so we check first for
-        // WHERE_THE_FUCK_IS_THE_CUP --> then we do not need
-        // abs(cur - last_old) < WEIGHT_EPSILON
-        if(millis() - last_millis > BOTTLE_EMPTY_INTERVAL) {
-            // note that ads1231_get_grams() blocks ~100ms, so
-            // BOTTLE_EMPTY_INTERVAL is not accurate.
-            // Note: first time the check always passes, then within
-            // BOTTLE_EMPTY_INTERVAL additional weight needs to be measured
-            // in the cup.
-            if (cur - last_old < WEIGHT_EPSILON) {
-                return BOTTLE_EMPTY; // Weight does not change means bottle is empty
-            }
-            last_old = cur;
-            last_millis = millis();
-        }
-
-        last = cur;
     }
 }
 
@@ -280,12 +664,12 @@ errv_t wait_for_cup() {
     return 0;
     #endif
 
-    int weight;
-    RETURN_IFN_0(ads1231_get_grams(weight));
+    weight_t weight;
+    RETURN_IFN_0(ads1231_get_weight(weight));
     if (weight < WEIGHT_EPSILON) {
         MSG("WAITING_FOR_CUP");
         print_lcd("WAITING_FOR_CUP", 2);
-        errv_t ret = delay_until(CUP_TIMEOUT, 0, false);
+        errv_t ret = delay_until(CUP_TIMEOUT, 0);
         if (ret == DELAY_UNTIL_TIMEOUT) {
             return CUP_TIMEOUT_REACHED;
         }
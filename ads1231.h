@@ -5,18 +5,95 @@
 #ifndef ADS1231_H
 #define ADS1231_H
 
+#include <stdint.h>
 #include "errors.h"
+#include "config.h"
 
-extern unsigned long ads1231_last_millis;
-extern int ads1231_offset;
+// Number of samples kept by the interrupt handler, must divide 256
+#define ADS1231_RING_SIZE 16
+
+// Arguments of ads1231_set_mode()
+#define ADS1231_IDLE     0    // 10 samples per second, strong filtering
+#define ADS1231_SETTLING 1    // 80 samples per second, waiting for stable weight
+#define ADS1231_POURING  2    // 80 samples per second, low latency filtering
+
+// State of the SPEED pin
+#define ADS1231_SLOW 0    // 10 samples per second, less noise
+#define ADS1231_FAST 1    // 80 samples per second, used while pouring
+
+// Number of filtered weights kept for ads1231_get_stability(), must divide
+// 256. Should cover ADS1231_STABLE_WINDOW at 80 samples per second.
+#define ADS1231_HISTORY_SIZE 32
+
+// Milliseconds between two samples (80 samples per second is 12.5ms)
+#define ADS1231_PERIOD_SLOW 100
+#define ADS1231_PERIOD_FAST 13
+
+// Sample periods until the digital filter has settled after power up or a
+// change of the speed (see datasheet, "Settling Time")
+#define ADS1231_SETTLING_SAMPLES 4
+
+// Weights are fixed point numbers in centigrams (1/100 gram), the ADS1231
+// resolves ~0.64 milligrams per count.
+typedef long weight_t;
+
+// Convert whole grams to weight_t
+#define GRAMS(grams) ((weight_t)(grams) * 100)
+
+/*
+ * Fixed point representation of 100/ADS1231_DIVISOR, evaluated at compile
+ * time:
+ *     centigrams = raw * ADS1231_WEIGHT_MULT / 2^ADS1231_WEIGHT_SHIFT
+ * This replaces a float division per sample. ADS1231_WEIGHT_MULT has 31 bits
+ * and raw 24 bits, so a 32x32->64 bit multiply is enough. The shift is done
+ * on the upper 32 bits of the product only.
+ */
+#define ADS1231_WEIGHT_SHIFT 34
+#define ADS1231_WEIGHT_MULT  ((int32_t)(((1LL << ADS1231_WEIGHT_SHIFT) * 100000000LL \
+                               + ADS1231_DIVISOR_E6 / 2) / ADS1231_DIVISOR_E6))
+
+/*
+ * Convert a raw value to a weight, i.e.
+ *     100 * raw / ADS1231_DIVISOR + offset
+ * truncated towards zero like the float version, but in fixed point (see
+ * ADS1231_WEIGHT_MULT). Checked against all 24 bit raw values by
+ * test/raw_to_weight.cpp ("make test").
+ */
+static inline weight_t ads1231_raw_to_weight(long raw, weight_t offset)
+{
+    int64_t product = (int64_t)(int32_t)raw * ADS1231_WEIGHT_MULT;
+    int32_t high = (int32_t)(product >> 32);
+    const int32_t frac_mask = (1L << (ADS1231_WEIGHT_SHIFT - 32)) - 1;
+    weight_t weight = (weight_t)(high >> (ADS1231_WEIGHT_SHIFT - 32)) + offset;
+    // the shift rounds down, round up again if negative and not exact
+    if (weight < 0 && ((uint32_t)product != 0 || (high & frac_mask) != 0))
+        weight++;
+    return weight;
+}
+
+// A raw sample and the time it was captured
+struct ads1231_sample {
+    unsigned long millis;
+    long raw;
+};
+
+extern weight_t ads1231_offset;
 
 void ads1231_init(void);
+void ads1231_set_mode(unsigned char mode);
+void ads1231_note_motion(void);
+unsigned int ads1231_sample_period(void);
+errv_t ads1231_get_sample(ads1231_sample& sample);
 errv_t ads1231_get_value(long& val);
-errv_t ads1231_get_grams(int& grams);
-errv_t ads1231_get_stable_grams(int& grams);
-errv_t ads1231_get_noblock(int& grams);
-errv_t ads1231_tare(int& grams);
-errv_t delay_until(long max_delay, int max_weight, bool pour_handling, bool revers=false);
+int weight_to_grams(weight_t weight);
+errv_t ads1231_get_weight(weight_t& weight);
+errv_t ads1231_get_stability(weight_t& weight, unsigned char& confidence);
+errv_t ads1231_get_flow(long& flow);
+errv_t ads1231_get_stable_weight(weight_t& weight);
+errv_t ads1231_get_noblock(weight_t& weight);
+errv_t ads1231_tare(weight_t& weight);
+void ads1231_auto_zero(void);
+errv_t delay_until(long max_delay, weight_t max_weight, bool revers=false);
 errv_t wait_for_cup();
 
 #endif
@@ -26,6 +26,7 @@
 #include "errors.h"
 #include "config.h"
 #include "lcd.h"
+#include "planner.h"
 
 
 
@@ -40,8 +41,15 @@ DEFINE_BOTTLES();
 unsigned char drink_btns[][9] = DRINK_BTNS;
 
 void parse_int_params(int* params, int size);
+void parse_gram_params(weight_t* amounts);
+bool parse_recipe(weight_t* amounts);
+Bottle* parse_bottle_param(int* params, int size);
+void send_upright_offset(Bottle& bottle);
+void send_trickle(Bottle& bottle);
+void send_fill(Bottle& bottle);
+void send_density(Bottle& bottle);
 void init_drink_btns();
-errv_t pour_cocktail(int* requested_amount);
+errv_t pour_cocktail(weight_t* requested_amount, bool send_ml=false);
 errv_t process_drink_btns();
 errv_t do_stuff();
 errv_t dancing_bottles();
@@ -95,26 +103,37 @@ void loop() {
 }
 
 errv_t do_stuff() {
+#ifndef WITHOUT_SCALE
+  // compensate drift of the scale while idle and no cup is there
+  ads1231_auto_zero();
+#endif
+
   // print some stuff every SEND_READY_INTERVAL milliseconds while idle
   IF_HAS_TIME_PASSED(SEND_READY_INTERVAL)  {
-    int weight = 0;
+    weight_t weight = 0;
 #ifndef WITHOUT_SCALE
-    RETURN_IFN_0(ads1231_get_grams(weight));
+    // idle, back to 10 samples per second if pouring was interrupted
+    ads1231_set_mode(ADS1231_IDLE);
+    RETURN_IFN_0(ads1231_get_weight(weight));
 #endif
+    int grams = weight_to_grams(weight);
 
-    // send message: READY weight is_cup_there
+    // send message: READY weight is_cup_there [weight_centigrams]
     String msg = String("READY ")
-                 + String(weight) + String(" ")
+                 + String(grams) + String(" ")
                  + String(weight > WEIGHT_EPSILON ? 1 : 0);
+#ifdef SEND_CENTIGRAMS
+    msg += String(" ") + String(weight);
+#endif
     MSG(msg);
 
     String sep = String("   ");
-    if (weight > 10)
+    if (grams > 10)
         sep = String("  ");
-    if (weight > 100)
+    if (grams > 100)
         sep = String(" ");
     String lcd_msg = String("Weight=")
-        + String(weight) + sep + String("Cup=")
+        + String(grams) + sep + String("Cup=")
         + String(weight > WEIGHT_EPSILON ? 1 : 0);
     print_lcd(lcd_msg, 1);
     print_lcd("READY", 2);
@@ -143,10 +162,41 @@ errv_t do_stuff() {
 
     // Example: POUR 0 20 10 30 10 0 40\r\n
     if (cmd_str.equals("POUR")) {
-      int requested_amount[bottles_nr];
-      parse_int_params(requested_amount, bottles_nr); // Also handles the "\r\n"
+      weight_t requested_amount[bottles_nr];
+      parse_gram_params(requested_amount); // Also handles the "\r\n"
       return pour_cocktail(requested_amount);
     }
+    // Example: POUR_ML 0 20 10 30 10 0 40\r\n
+    // Arduino will then print the amounts in grams: "GRAMS 0 19 10 30 10 0 38"
+    else if (cmd_str.equals("POUR_ML")) {
+      int requested_ml[bottles_nr];
+      parse_int_params(requested_ml, bottles_nr); // Also handles the "\r\n"
+      weight_t requested_amount[bottles_nr];
+      String msg = "GRAMS ";
+      for (int i = 0; i < bottles_nr; i++) {
+        // centigrams, only the message is rounded to grams
+        requested_amount[i] = bottles[i].ml_to_weight(requested_ml[i]);
+        msg += String(weight_to_grams(requested_amount[i])) + String(" ");
+      }
+      MSG(msg);
+      return pour_cocktail(requested_amount, true);
+    }
+    // Example: ESTIMATE 0 20 10 30 10 0 40 ; 0 0 10 0 0 0 20\r\n
+    // Arduino will then print "ESTIMATE 14250 6100" (one ETA per recipe)
+    else if (cmd_str.equals("ESTIMATE")) {
+      String msg = "ESTIMATE";
+      bool more = true;
+      while (more) {
+        weight_t requested_amount[bottles_nr];
+        more = parse_recipe(requested_amount); // Also handles the "\r\n"
+        char order[bottles_nr];
+        int order_nr;
+        long estimated_millis = plan_cocktail(bottles, bottles_nr,
+                                  requested_amount, order, order_nr);
+        msg += String(" ") + String(estimated_millis);
+      }
+      MSG(msg);
+    }
     // Example: TURN_BOTTLE 3 2100\r\n
     else if (cmd_str.equals("TURN")) {
       // turn bottle to specific position
@@ -157,6 +207,90 @@ errv_t do_stuff() {
       // as microseconds second parameter
       return bottles[params[0]].turn_to(params[1], TURN_DOWN_DELAY);
     }
+    // Example: OFFSET 3\r\n
+    // Arduino will then print "OFFSET 3 520"
+    else if (cmd_str.equals("OFFSET")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      send_upright_offset(*bottle);
+    }
+    // Example: OFFSET_RESET 3\r\n
+    else if (cmd_str.equals("OFFSET_RESET")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      bottle->set_upright_offset(UPGRIGHT_OFFSET);
+      send_upright_offset(*bottle);
+    }
+    // Example: TRICKLE 3\r\n
+    // Arduino will then print "TRICKLE 3 80 1450"
+    else if (cmd_str.equals("TRICKLE")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      send_trickle(*bottle);
+    }
+    // Example: SET_TRICKLE 3 70\r\n
+    else if (cmd_str.equals("SET_TRICKLE")) {
+      int params[2];
+      Bottle* bottle = parse_bottle_param(params, 2); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      bottle->set_fast_percent(params[1]);
+      send_trickle(*bottle);
+    }
+    // Example: CALIBRATE 3\r\n
+    // Arduino will then print "CALIBRATED 3 1620"
+    else if (cmd_str.equals("CALIBRATE")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      print_lcd("CALIBRATING", 2);
+      RETURN_IFN_0(bottle->calibrate_bottle_pos());
+      MSG(String("CALIBRATED ") + String(params[0]) + String(" ")
+          + String(bottle->get_onset_pos()));
+    }
+    // Example: FILL 3\r\n
+    // Arduino will then print "FILL 3 420"
+    else if (cmd_str.equals("FILL")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      send_fill(*bottle);
+    }
+    // Example: REFILL 3 700\r\n
+    else if (cmd_str.equals("REFILL")) {
+      int params[2];
+      Bottle* bottle = parse_bottle_param(params, 2); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      bottle->set_fill(params[1] < 0 ? -1 : GRAMS(params[1]));
+      send_fill(*bottle);
+    }
+    // Example: DENSITY 3\r\n
+    // Arduino will then print "DENSITY 3 950"
+    else if (cmd_str.equals("DENSITY")) {
+      int params[1];
+      Bottle* bottle = parse_bottle_param(params, 1); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      send_density(*bottle);
+    }
+    // Example: SET_DENSITY 3 950\r\n
+    else if (cmd_str.equals("SET_DENSITY")) {
+      int params[2];
+      Bottle* bottle = parse_bottle_param(params, 2); // Also handles the "\r\n"
+      if (bottle == NULL)
+        return INVALID_COMMAND;
+      bottle->set_density(params[1]);
+      send_density(*bottle);
+    }
     // Example: ECHO ENJOY\r\n
     // Arduino will then print "ENJOY"
     // This is a workaround to resend garbled messages manually.
@@ -173,11 +307,11 @@ errv_t do_stuff() {
     // Example: TARE\r\n
     else if (cmd_str.equals("TARE\r\n")) {
 #ifndef WITHOUT_SCALE
-      int weight;
+      weight_t weight;
       DEBUG_MSG_LN("Measuring");
       RETURN_IFN_0(ads1231_tare(weight));
       DEBUG_MSG_LN(
-        String("Scale tared to ") + String(-weight)
+        String("Scale tared to ") + String(-weight) + String("cg")
       );
 #endif
     }
@@ -244,10 +378,10 @@ errv_t process_drink_btns() {
       DEBUG_MSG_LN(String("Button ") + String(i) +
                    String(" (counting from 0) pressed"));
 
-      // TODO is this the best way to cast an char array --> int array?
-      int requested_amount[bottles_nr];
+      // TODO is this the best way to cast an char array --> weight_t array?
+      weight_t requested_amount[bottles_nr];
       for (int j = 0; j < bottles_nr; j++) {
-        requested_amount[j] = drink_btns[i][j];
+        requested_amount[j] = GRAMS(drink_btns[i][j]);
       }
       return pour_cocktail(requested_amount);
     }
@@ -257,6 +391,44 @@ errv_t process_drink_btns() {
 }
 
 
+/**
+   Send learned upright offset of a bottle: OFFSET bottle_nr offset_cg
+*/
+void send_upright_offset(Bottle& bottle) {
+  MSG(String("OFFSET ") + String(bottle.number) + String(" ")
+      + String(bottle.upright_offset));
+}
+
+
+/**
+   Send two phase pouring parameters of a bottle:
+   TRICKLE bottle_nr fast_percent trickle_pos
+*/
+void send_trickle(Bottle& bottle) {
+  MSG(String("TRICKLE ") + String(bottle.number) + String(" ")
+      + String(bottle.fast_percent) + String(" ")
+      + String(bottle.get_trickle_pos()));
+}
+
+
+/**
+   Send liquid left in a bottle: FILL bottle_nr grams (-1 if unknown)
+*/
+void send_fill(Bottle& bottle) {
+  int grams = (bottle.fill < 0) ? -1 : weight_to_grams(bottle.fill);
+  MSG(String("FILL ") + String(bottle.number) + String(" ") + String(grams));
+}
+
+
+/**
+   Send density of the liquid in a bottle: DENSITY bottle_nr mg_per_ml
+*/
+void send_density(Bottle& bottle) {
+  MSG(String("DENSITY ") + String(bottle.number) + String(" ")
+      + String(bottle.density));
+}
+
+
 /**
    Parse space separated int values from Serial to array.
 */
@@ -272,17 +444,72 @@ void parse_int_params(int* params, int size) {
   Serial.readBytes(junk, 2);
 }
 
+/**
+   Parse 'size' int values from Serial (see parse_int_params()), the first one
+   is a bottle number. Returns the bottle or NULL if the number is invalid.
+*/
+Bottle* parse_bottle_param(int* params, int size) {
+  parse_int_params(params, size);
+  if (params[0] < 0 || params[0] >= bottles_nr)
+    return NULL;
+  return &bottles[params[0]];
+}
+
+/**
+   Parse bottles_nr amounts in grams from Serial to 'amounts' (centigrams).
+*/
+void parse_gram_params(weight_t* amounts) {
+  int params[bottles_nr];
+  parse_int_params(params, bottles_nr); // Also handles the "\r\n"
+  for (int i = 0; i < bottles_nr; i++)
+    amounts[i] = GRAMS(params[i]);
+}
+
+/**
+   Parse one recipe of bottles_nr amounts in grams from Serial to 'amounts'
+   (centigrams). Returns true if another recipe follows (separated by ';'),
+   otherwise the terminating "\r\n" is read.
+*/
+bool parse_recipe(weight_t* amounts) {
+  for (int i = 0; i < bottles_nr; i++)
+    amounts[i] = GRAMS(Serial.parseInt());
+
+  // parseInt() stops before the next character, wait for it
+  unsigned long start = millis();
+  while (millis() - start < SERIAL_TIMEOUT) {
+    int c = Serial.peek();
+    if (c == ' ') {
+      Serial.read();
+    }
+    else if (c == ';') {
+      Serial.read();
+      return true;
+    }
+    else if (c >= 0) {
+      break;
+    }
+  }
+
+  // The line is terminated by \r\n - read two characters and throw them away.
+  char junk[2];
+  Serial.readBytes(junk, 2);
+  return false;
+}
+
 /**
    Pouring procedure.
    Waits for cup and turns each bottle in the order they were defined.
-   'requested_amount' is the amount of liquid in grams to be poured from
-   each bottle(int array of size bottles_nr).
+   'requested_amount' is the amount of liquid in centigrams (see weight_t) to
+   be poured from each bottle (array of size bottles_nr). The serial protocol
+   uses grams.
+   If 'send_ml' is true, the measured amounts are also sent in milliliters
+   (ENJOY_ML) before ENJOY.
 */
-errv_t pour_cocktail(int* requested_amount) {
+errv_t pour_cocktail(weight_t* requested_amount, bool send_ml) {
   {
     String msg = "POUR ";
     for (int i = 0; i < bottles_nr; i++)
-      msg += String(requested_amount[i]) + String(" ");
+      msg += String(weight_to_grams(requested_amount[i])) + String(" ");
     print_lcd(msg, 2);
   }
 
@@ -291,46 +518,101 @@ errv_t pour_cocktail(int* requested_amount) {
   for (int i = 0; i < bottles_nr; i++) {
     sum += requested_amount[i];
   }
-  if (sum > MAX_DRINK_GRAMS) {
+  if (sum > GRAMS(MAX_DRINK_GRAMS)) {
     return MAX_DRINK_GRAMS_EXCEEDED;
   }
+  // ... and never more than fits into the glass
+  sum = 0;
+  for (int i = 0; i < bottles_nr; i++) {
+    sum += bottles[i].weight_to_ml(requested_amount[i]);
+  }
+  if (sum > MAX_DRINK_ML) {
+    return MAX_DRINK_ML_EXCEEDED;
+  }
 
-  // wait until weight > WEIGHT_EPSILON or CUP_TIMEOUT reached
-  RETURN_IFN_0(wait_for_cup());
+  // Check fill levels before starting, refilling now is much better than
+  // waiting for BOTTLE_EMPTY in the middle of the cocktail
+  for (int i = 0; i < bottles_nr; i++) {
+    if (requested_amount[i] == 0 || !bottles[i].is_low(requested_amount[i]))
+      continue;
+    ERROR(c_strerror(BOTTLE_LOW) + String(" ") + String(i) + String(" ")
+          + String(weight_to_grams(bottles[i].fill)));
+    print_lcd(c_strerror(BOTTLE_LOW) + String(" ") + String(i), 2);
+    RETURN_IFN_0(wait_for_resume()); // might return ABORTED
+    bottles[i].set_fill(GRAMS(BOTTLE_CAPACITY)); // refilled
+  }
+
+  // Fastest order of the bottles, measured_amount and ENJOY stay in bottle
+  // order
+  char order[bottles_nr];
+  int order_nr;
+  long estimated_millis = plan_cocktail(bottles, bottles_nr, requested_amount,
+                                        order, order_nr);
+  MSG(String("ETA ") + String(estimated_millis));
+
+  // wait until weight > WEIGHT_EPSILON or CUP_TIMEOUT reached, no need to if
+  // all amounts are 0 (ENJOY with zeros is sent then)
+  if (order_nr > 0)
+    RETURN_IFN_0(wait_for_cup());
 
   // Actually poured liquid for each bottle
-  int measured_amount[bottles_nr];
+  weight_t measured_amount[bottles_nr];
   // initializing array with 0
-  memset(measured_amount, 0, sizeof(int) * bottles_nr);
+  memset(measured_amount, 0, sizeof(weight_t) * bottles_nr);
 
   Bottle *cur_bottle = NULL;
   Bottle *last_bottle = NULL;
-  for (int i = 0; i < bottles_nr; i++) {
+  int last_i = 0;
+  weight_t last_orig_weight = 0;
+  // Weight after the drops of last_bottle arrived, -1 if not measured yet.
+  // This is also the weight before pouring cur_bottle.
+  weight_t settled_weight = -1;
+  for (int k = 0; k < order_nr; k++) {
+    int i = order[k];
+    cur_bottle = &bottles[i];
 
-    // This bottle is not used for the cocktail. Skip it silently.
-    if (requested_amount[i] == 0) {
-      continue;
-    }
+    if (last_bottle != 0) { // On the first iteration last_bottle is NULL
+      // weighs the drops of last_bottle while moving, stops if the cup is
+      // removed
+      errv_t ret;
+      bool cup_replaced = false;
+      while ((ret = crossfade(last_bottle, cur_bottle, TURN_UP_DELAY,
+                              &settled_weight)) == WHERE_THE_FUCK_IS_THE_CUP) {
+        ERROR(c_strerror(WHERE_THE_FUCK_IS_THE_CUP));
+        ret = wait_for_cup();
+        print_lcd("", 2);  // clear error
+        if (ret)
+          break;
+        // the drops of last_bottle went into the old cup
+        last_bottle->discard_drip();
+        cup_replaced = true;
+      }
+      // At this point, last_bottle is up and cur_bottle is at pause position
 
-    // we cannot pour less than UPGRIGHT_OFFSET --> do not pour if it is
-    // less than UPGRIGHT_OFFSET/2 and print warning...
-    if (requested_amount[i] < UPGRIGHT_OFFSET) {
-      if (UPGRIGHT_OFFSET / 2 > requested_amount[i]) {
-        DEBUG_MSG_LN("Will not pour");
-        continue;
-      } else {
-        DEBUG_MSG_LN("Will pour too much");
+      // The amount of last_bottle cannot be measured in another cup (it is
+      // reported as 0 then). If last_bottle is topped up, it is turned back
+      // to pause position and cur_bottle is turned up meanwhile.
+      if (ret == 0 && !cup_replaced)
+        ret = last_bottle->finish_pour(requested_amount[last_i],
+                       last_orig_weight, settled_weight, measured_amount[last_i],
+                       cur_bottle);
+      last_bottle->turn_up(TURN_UP_DELAY, false);
+      if (ret) {
+        cur_bottle->turn_up(FAST_TURN_UP_DELAY, false);
+        return ret;
       }
     }
 
-    cur_bottle = &bottles[i];
-
-    if (last_bottle != 0) { // On the first iteration last_bottle is NULL
-      RETURN_IFN_0(crossfade(last_bottle, cur_bottle, TURN_UP_DELAY));
-      // At this point, last_bottle is up and cur_bottle is at pause position
+    if (k > 0) {
+      // time left, cur_bottle is at pause position (up if last_bottle was
+      // topped up)
+      bool at_pause = cur_bottle->servo.readMicroseconds() != cur_bottle->pos_up;
+      MSG(String("ETA ") + String(estimate_cocktail_millis(bottles,
+                      requested_amount, order + k, order_nr - k, at_pause)));
     }
 
-    errv_t ret = cur_bottle->pour(requested_amount[i], measured_amount[i]);
+    weight_t orig_weight = settled_weight;
+    errv_t ret = cur_bottle->pour(requested_amount[i], orig_weight);
     if (ret) {
       // if ABORTED was triggered during turn_to(), bottle is up already
       // but that does not matter
@@ -342,30 +624,48 @@ errv_t pour_cocktail(int* requested_amount) {
 
     // Save bottle for next iteration
     last_bottle = cur_bottle;
+    last_i = i;
+    last_orig_weight = orig_weight;
+    settled_weight = -1;
   }
 
-  // Last bottle is hanging at pause position at this point. Turn up completely.
-  // no need to check return value here - too late for ABORT
-  last_bottle->turn_up(TURN_UP_DELAY);
+  // Last bottle is hanging at pause position at this point, wait for the
+  // drops there (might be topped up), then turn up completely. last_bottle
+  // is NULL if nothing was poured.
+  if (last_bottle != NULL) {
+    errv_t ret = last_bottle->finish_pour(requested_amount[last_i],
+                     last_orig_weight, settled_weight, measured_amount[last_i]);
+    // no need to check return value here - too late for ABORT
+    last_bottle->turn_up(TURN_UP_DELAY);
+    RETURN_IFN_0(ret);
+  }
 
   // check if measured_amount makes sense
   // if not we print an error, but still send enjoy with wrong values because
   // we do not want change anything in java (values are ignored in java)
   // see also https://github.com/rfjakob/barwin-arduino/issues/11
   for (int i = 0; i < bottles_nr; i++) {
-    int pour_error = measured_amount[i] - requested_amount[i];
-    if (measured_amount[i] > MAX_DRINK_GRAMS
-        || measured_amount[i] < 0
+    int measured_grams = weight_to_grams(measured_amount[i]);
+    int pour_error = weight_to_grams(measured_amount[i] - requested_amount[i]);
+    if (measured_grams > MAX_DRINK_GRAMS
+        || measured_grams < 0
         || abs(pour_error) > MAX_POUR_ERROR) {
       ERROR(c_strerror(POURING_INACCURATE));
       break;
     }
   }
 
+  if (send_ml) {
+    String msg = "ENJOY_ML ";
+    for (int i = 0; i < bottles_nr; i++)
+      msg += String(bottles[i].weight_to_ml(measured_amount[i])) + String(" ");
+    MSG(msg);
+  }
+
   // Send success or error message, measured_amount as params
   String msg = "ENJOY ";
   for (int i = 0; i < bottles_nr; i++)
-    msg += String(measured_amount[i]) + String(" ");
+    msg += String(weight_to_grams(measured_amount[i])) + String(" ");
   MSG(msg);
   print_lcd(msg, 2);
 
@@ -9,21 +9,69 @@
 #include "utils.h"
 #include "errors.h"
 #include "config.h"
+#include "custom_eeprom.h"
 
 
 /*
  * Init bottles.
- * Attach servos and turn to initial position.
+ * Attach servos and turn to initial position, load learned values from EEPROM.
  * 'bottles' is an array (size 'bottles_nr') of Bottle objects.
  */
 void Bottle::init(Bottle* bottles, int bottles_nr) {
     for (int i=0; i < bottles_nr; i++) {
+        bottles[i].read_eeprom();
         bottles[i].servo.attach(bottles[i].pin);
         bottles[i].servo.writeMicroseconds(bottles[i].pos_up); // Make sure bottle is pointing up
         delay(500);
     }
 }
 
+/*
+ * Load calibrated and learned values from EEPROM (see BOTTLE_EEPROM_POS()).
+ * Values which were never written (or are out of range) keep their defaults.
+ */
+void Bottle::read_eeprom() {
+    long value;
+    int pos, percent;
+
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_UPGRIGHT_OFFSET_EEPROM), value);
+    // -1 is a valid offset, but also what an erased EEPROM reads
+    if (value != EEPROM_ERASED_LONG
+            && value >= UPGRIGHT_OFFSET_MIN && value <= UPGRIGHT_OFFSET_MAX)
+        upright_offset = value;
+
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_FILL_EEPROM), value);
+    fill = (value < 0) ? -1 : value;
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_FLOW_EEPROM), value);
+    flow_per_tilt = (value <= 0) ? -1 : value;
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_PULSE_MASS_EEPROM), value);
+    if (value > 0 && value < GRAMS(MAX_POUR_ERROR))
+        pulse_mass = value;
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_DRIP_MILLIS_EEPROM), pos);
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_DRIP_MASS_EEPROM), value);
+    if (pos >= 0 && value >= 0 && value < GRAMS(MAX_POUR_ERROR)) {
+        drip_millis = pos;
+        drip_mass = value;
+    }
+
+    int min_pos = min(pos_down, pos_up);
+    int max_pos = max(pos_down, pos_up);
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_ONSET_POS_EEPROM), pos);
+    if (pos >= min_pos && pos <= max_pos) {
+        onset_pos = pos;
+        trickle_pos = get_default_trickle_pos();
+    }
+
+    if (read_learned_trickle_pos(pos))
+        trickle_pos = pos;
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_FAST_PERCENT_EEPROM), percent);
+    if (percent >= 0 && percent <= 100)
+        fast_percent = percent;
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_DENSITY_EEPROM), pos);
+    if (pos >= DENSITY_MIN && pos <= DENSITY_MAX)
+        density = pos;
+}
+
 
 /**
  * Bottle constructor.
@@ -32,7 +80,12 @@ void Bottle::init(Bottle* bottles, int bottles_nr) {
  * bottles_init().
  */
 Bottle::Bottle(unsigned char _number, unsigned char _pin, int _pos_down, int _pos_up) :
-    number(_number), pin(_pin), pos_down(_pos_down), pos_up(_pos_up) {
+    number(_number), pin(_pin), pos_down(_pos_down), pos_up(_pos_up),
+    upright_offset(UPGRIGHT_OFFSET), onset_pos(-1), fill(-1), flow_per_tilt(-1),
+    pulse_mass(TOPUP_PULSE_MASS), drip_mass(0), drip_millis(-1),
+    pause_weight(0), pause_millis(0),
+    fast_percent(POUR_FAST_PERCENT), density(DENSITY) {
+    trickle_pos = get_default_trickle_pos();
 }
 
 /**
@@ -40,7 +93,8 @@ Bottle::Bottle(unsigned char _number, unsigned char _pin, int _pos_down, int _po
  * milliseconds between steps (speed = 1/delay). If check_weight weight
  * is true, might abort with WHERE_THE_FUCK_IS_THE_CUP error. If a valid pointer
  * stable_weight is passed, turns bottle until a stable weight is measured
- * (returns WEIGHT_NOT_STABLE if pos is reached before weight stable).
+ * (see ads1231_get_stability(), returns WEIGHT_NOT_STABLE if pos is reached
+ * before weight stable).
  *
  * Returns 0 when the position is reached or SERVO_OUT_OF_RANGE on error.
  *
@@ -48,10 +102,7 @@ Bottle::Bottle(unsigned char _number, unsigned char _pin, int _pos_down, int _po
  *     /usr/share/arduino/libraries/Servo/Servo.cpp
  *
  */
-errv_t Bottle::turn_to(int pos, int delay_ms, bool check_weight, int* stable_weight, bool enable_abortcheck) {
-    int weight_previous1 = -9999;  // just any impossible value
-    int weight_previous2 = -9999;  // ..before we have real values
-
+errv_t Bottle::turn_to(int pos, int delay_ms, bool check_weight, weight_t* stable_weight, bool enable_abortcheck) {
     if (pos < SERVO_MIN || pos > SERVO_MAX) {
         DEBUG_MSG_LN("Invalid pos");
         return SERVO_OUT_OF_RANGE;
@@ -97,7 +148,7 @@ errv_t Bottle::turn_to(int pos, int delay_ms, bool check_weight, int* stable_wei
 
         #ifndef WITHOUT_SCALE
         if (check_weight || stable_weight) {
-            int weight;
+            weight_t weight;
             int ret = ads1231_get_noblock(weight);
             if (ret == 0) {
                 // we got a valid weight from scale
@@ -105,15 +156,14 @@ errv_t Bottle::turn_to(int pos, int delay_ms, bool check_weight, int* stable_wei
                     return WHERE_THE_FUCK_IS_THE_CUP;
                 }
 
-                // get next weight sample and return if weight is stable
+                // return if weight is stable
                 if (stable_weight) {
-                    if (weight_previous2 == weight_previous1
-                            && weight_previous1 == weight) {
+                    unsigned char confidence;
+                    RETURN_IFN_0(ads1231_get_stability(weight, confidence));
+                    if (confidence == 100) {
                         *stable_weight = weight;
                         return 0;
                     }
-                    weight_previous2 = weight_previous1;
-                    weight_previous1 = weight;
                 }
             }
             else if (ret != ADS1231_WOULD_BLOCK) {
@@ -127,6 +177,7 @@ errv_t Bottle::turn_to(int pos, int delay_ms, bool check_weight, int* stable_wei
         // turn servo one step
         delay(delay_ms);
         servo.writeMicroseconds(i);
+        ads1231_note_motion();
     }
 
     // pos reached before weight stable
@@ -148,7 +199,101 @@ errv_t Bottle::turn_up(int delay_ms, bool enable_abortcheck) {
  * Turn bottle to pouring position.
  */
 errv_t Bottle::turn_down(int delay_ms, bool check_weight) {
-    return turn_to(pos_down, delay_ms, check_weight);
+    return turn_down_to(pos_down, delay_ms, check_weight);
+}
+
+/**
+ * Turn bottle down to 'pos'. If the flow onset is calibrated (see
+ * calibrate_bottle_pos()), the dead travel until ONSET_MARGIN above the onset
+ * is turned with ONSET_JUMP_DELAY, only the rest with 'delay_ms'.
+ */
+errv_t Bottle::turn_down_to(int pos, int delay_ms, bool check_weight) {
+    if (onset_pos >= 0) {
+        int jump_pos = get_onset_pos() + ((pos_up > pos_down) ? ONSET_MARGIN : -ONSET_MARGIN);
+        long current_pos = servo.readMicroseconds();
+        // jump_pos between current_pos and pos?
+        if ((current_pos - jump_pos) * (jump_pos - pos) > 0)
+            RETURN_IFN_0(turn_to(jump_pos, ONSET_JUMP_DELAY, check_weight));
+    }
+    return turn_to(pos, delay_ms, check_weight);
+}
+
+/**
+ * Read the trickle position learned by learn_trickle_pos() from EEPROM to
+ * 'pos'. Returns false if none was learned (or it is out of range).
+ */
+bool Bottle::read_learned_trickle_pos(int& pos)
+{
+    EEPROM_read(BOTTLE_EEPROM_POS(number, BOTTLE_TRICKLE_POS_EEPROM), pos);
+    return pos >= min(pos_down, get_pause_pos())
+           && pos <= max(pos_down, get_pause_pos());
+}
+
+/**
+ * Find the servo position where liquid starts to flow: turn down slowly from
+ * the pause position with CALIBRATION_TURN_DELAY until the weight increased
+ * by CALIBRATION_ONSET_WEIGHT. The position is corrected by the latency of
+ * the scale and stored in EEPROM, the default trickle position follows it
+ * (as in read_eeprom()) unless one was learned. Needs a cup on the scale, a
+ * little bit is poured into it, which is subtracted from the fill level.
+ * Returns 0 on success, BOTTLE_EMPTY if nothing flows until pos_down or other
+ * errors (scale error, ABORTED, WHERE_THE_FUCK_IS_THE_CUP...).
+ */
+errv_t Bottle::calibrate_bottle_pos() {
+    #ifdef WITHOUT_SCALE
+    return 0;
+    #else
+    weight_t orig_weight;
+    RETURN_IFN_0(wait_for_cup());
+    ads1231_set_mode(ADS1231_SETTLING);
+    RETURN_IFN_0(turn_to_pause_pos(TURN_DOWN_DELAY));
+    RETURN_IFN_0(ads1231_get_stable_weight(orig_weight));
+    // low latency filtering like in pour(), SCALE_LATENCY_MILLIS is for this
+    ads1231_set_mode(ADS1231_POURING);
+
+    int step = (pos_down < pos_up) ? -1 : 1;
+    int pos = servo.readMicroseconds();
+    weight_t weight = orig_weight;
+    errv_t ret = 0;
+    while (weight < orig_weight + CALIBRATION_ONSET_WEIGHT) {
+        if (pos == pos_down) {
+            ret = BOTTLE_EMPTY;
+            break;
+        }
+        // not using turn_to(), it would print debug output for every step
+        pos += step;
+        delay(CALIBRATION_TURN_DELAY);
+        servo.writeMicroseconds(pos);
+        ads1231_note_motion();
+
+        ret = check_aborted();
+        if (ret == 0)
+            ret = ads1231_get_weight(weight);
+        if (ret == 0 && weight < WEIGHT_EPSILON)
+            ret = WHERE_THE_FUCK_IS_THE_CUP;
+        if (ret)
+            break;
+    }
+    // never leave the bottle pouring
+    turn_up(FAST_TURN_UP_DELAY, false);
+    ads1231_set_mode(ADS1231_SETTLING);
+    RETURN_IFN_0(ret);
+
+    // the flow started before the scale noticed it
+    pos -= step * (SCALE_LATENCY_MILLIS + FALL_MILLIS) / CALIBRATION_TURN_DELAY;
+    pos -= get_tilt_compensation(); // onset_pos is for a full bottle
+    onset_pos = constrain(pos, min(pos_down, pos_up), max(pos_down, pos_up));
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_ONSET_POS_EEPROM), onset_pos);
+    int learned_pos;
+    if (!read_learned_trickle_pos(learned_pos))
+        trickle_pos = get_default_trickle_pos();
+
+    // account for what was poured
+    RETURN_IFN_0(ads1231_get_stable_weight(weight));
+    if (fill >= 0)
+        set_fill(max(fill - max(weight - orig_weight, 0), 0));
+    return 0;
+    #endif
 }
 
 /**
@@ -159,6 +304,28 @@ int Bottle::get_pause_pos()
 	return (pos_down + pos_up) / 2;
 }
 
+/**
+ * Returns the distance between up and pause position (unit: microseconds)
+ */
+int Bottle::get_pause_travel()
+{
+	return abs(pos_up - get_pause_pos());
+}
+
+/**
+ * Estimate the time (milliseconds) pour() needs for 'amount' (centigrams):
+ * turning down from pause position, pouring at the expected flow at pos_down
+ * (ESTIMATE_FLOW if not learned) and turning back.
+ */
+long Bottle::estimate_pour_millis(weight_t amount)
+{
+    long travel = abs(get_pause_pos() - pos_down);
+    long flow = get_expected_flow(pos_down);
+    if (flow < EMPTY_MIN_FLOW)
+        flow = ESTIMATE_FLOW;
+    return travel * (TURN_DOWN_DELAY + TURN_UP_DELAY) + amount * 1000 / flow;
+}
+
 /**
  * Turn bottle to pause position.
  * Used e.g. in case of WHERE_THE_FUCK_IS_THE_CUP error.
@@ -169,17 +336,567 @@ errv_t Bottle::turn_to_pause_pos(int delay_ms) {
 
 
 /**
- * Pour requested_amount grams from bottle..
+ * Returns how much further (microseconds, signed like the servo position)
+ * the bottle needs to be turned down than when full, depending on the fill
+ * level. 0 if the fill level is unknown.
+ */
+int Bottle::get_tilt_compensation()
+{
+    if (fill < 0)
+        return 0;
+    weight_t capacity = GRAMS(BOTTLE_CAPACITY);
+    long shift = ONSET_SHIFT_EMPTY * (capacity - min(fill, capacity)) / capacity;
+    return (pos_down < pos_up) ? -shift : shift;
+}
+
+/**
+ * Returns the calibrated flow onset for the current fill level or -1 if not
+ * calibrated (see calibrate_bottle_pos()).
+ */
+int Bottle::get_onset_pos()
+{
+    if (onset_pos < 0)
+        return -1;
+    return constrain(onset_pos + get_tilt_compensation(),
+                     min(pos_down, pos_up), max(pos_down, pos_up));
+}
+
+/**
+ * Returns the trickle position for the current fill level.
+ */
+int Bottle::get_trickle_pos()
+{
+    return constrain(trickle_pos + get_tilt_compensation(),
+                     min(pos_down, get_pause_pos()), max(pos_down, get_pause_pos()));
+}
+
+/**
+ * Returns the servo position where the liquid stops flowing when turning up
+ * (unit: microseconds). This is the flow onset if calibrated, otherwise
+ * estimated as CUTOFF_TURN_PERCENT of the way from pos_down to the pause
+ * position, corrected by the fill level.
+ */
+int Bottle::get_flow_stop_pos()
+{
+    if (onset_pos >= 0)
+        return get_onset_pos();
+    return pos_down + (long)(get_pause_pos() - pos_down) * CUTOFF_TURN_PERCENT / 100
+           + get_tilt_compensation();
+}
+
+/**
+ * Trickle position (for a full bottle) used until learned: a quarter of the
+ * way from where the flow stops to pos_down.
+ */
+int Bottle::get_default_trickle_pos()
+{
+    int stop_pos = get_flow_stop_pos() - get_tilt_compensation();
+    return stop_pos + (pos_down - stop_pos) / 4;
+}
+
+/**
+ * Set the liquid left in the bottle (centigrams, -1 if unknown) and store it
+ * in EEPROM.
+ */
+void Bottle::set_fill(weight_t _fill)
+{
+    fill = max(_fill, -1);
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_FILL_EEPROM), fill);
+}
+
+/**
+ * Returns true if less than BOTTLE_LOW_RESERVE would be left after pouring
+ * 'requested_amount' (centigrams). False if the fill level is unknown.
+ */
+bool Bottle::is_low(weight_t requested_amount)
+{
+    return fill >= 0 && fill - requested_amount < GRAMS(BOTTLE_LOW_RESERVE);
+}
+
+/**
+ * Set the density of the liquid (mg/ml) and store it in EEPROM. Values
+ * outside DENSITY_MIN..DENSITY_MAX are limited to this range.
+ */
+void Bottle::set_density(int _density)
+{
+    density = constrain(_density, DENSITY_MIN, DENSITY_MAX);
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_DENSITY_EEPROM), density);
+}
+
+/**
+ * Convert a volume of the liquid in this bottle (milliliters) to centigrams.
+ * 1 ml at 1 mg/ml is 0.1 centigrams.
+ */
+weight_t Bottle::ml_to_weight(long ml)
+{
+    return (ml * density + (ml >= 0 ? 5 : -5)) / 10;
+}
+
+/**
+ * Convert 'weight' (centigrams) of the liquid in this bottle to milliliters,
+ * rounded like weight_to_grams().
+ */
+long Bottle::weight_to_ml(weight_t weight)
+{
+    if (weight >= 0)
+        return (weight * 10 + density / 2) / density;
+    return (weight * 10 - density / 2) / density;
+}
+
+/**
+ * Predict the mass which still reaches the cup if we start turning up now,
+ * at a flow rate of 'flow' (centigrams per second). Liquid keeps flowing
+ * at full rate for SCALE_LATENCY_MILLIS + FALL_MILLIS, then decreases
+ * linearly to zero while turning to get_flow_stop_pos(). The learned
+ * upright_offset is added on top for whatever this model misses.
+ */
+weight_t Bottle::get_cutoff_mass(long flow)
+{
+    long turn_millis = (long)abs(servo.readMicroseconds() - get_flow_stop_pos())
+                       * TURN_UP_DELAY;
+    long lead_millis = SCALE_LATENCY_MILLIS + FALL_MILLIS + turn_millis / 2;
+    return flow * lead_millis / 1000 + drip_mass + upright_offset;
+}
+
+/**
+ * Set upright_offset (centigrams) and store it in EEPROM. The value is
+ * limited to UPGRIGHT_OFFSET_MIN..UPGRIGHT_OFFSET_MAX.
+ */
+void Bottle::set_upright_offset(weight_t offset)
+{
+    offset = constrain(offset, UPGRIGHT_OFFSET_MIN, UPGRIGHT_OFFSET_MAX);
+    if (offset == upright_offset)
+        return; // save EEPROM write cycles
+    upright_offset = offset;
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_UPGRIGHT_OFFSET_EEPROM), upright_offset);
+}
+
+/**
+ * Feed the pour error back into upright_offset: if we poured too much, the
+ * bottle needs to be turned up earlier next time and vice versa. Large errors
+ * are ignored, they are probably caused by something else (cup touched,
+ * bottle empty...).
+ */
+void Bottle::learn_upright_offset(weight_t requested_amount, weight_t measured_amount)
+{
+    weight_t error = measured_amount - requested_amount;
+    if (abs(error) > GRAMS(MAX_POUR_ERROR))
+        return;
+    set_upright_offset(upright_offset + (error >> UPGRIGHT_OFFSET_LEARN_SHIFT));
+}
+
+/**
+ * One step of the flow controller (see POUR_FLOW_CONTROL in config.h): turn
+ * the bottle to get the target flow for the 'remaining' amount (centigrams).
+ * 'flow' is the current flow (centigrams per second), 'integral' the state of
+ * the controller, which must be initialized with the current tilt multiplied
+ * by POUR_FLOW_KI_DIV. Must be called every POUR_FLOW_CONTROL_INTERVAL
+ * milliseconds.
+ */
+void Bottle::control_flow(weight_t remaining, long flow, long& integral)
+{
+    int flow_stop_pos = get_flow_stop_pos();
+    int max_tilt = abs(pos_down - flow_stop_pos);
+    long target_flow = constrain(remaining * 1000 / POUR_FLOW_APPROACH_MILLIS,
+                                 POUR_FLOW_MIN, POUR_FLOW_MAX);
+    long error = target_flow - flow;
+
+    // limit the integral to the servo range (anti windup)
+    integral = constrain(integral + error * POUR_FLOW_CONTROL_INTERVAL,
+                         0, (long)max_tilt * POUR_FLOW_KI_DIV);
+    long tilt = constrain(error / POUR_FLOW_KP_DIV + integral / POUR_FLOW_KI_DIV,
+                          0, max_tilt);
+
+    // tilt is the distance from flow_stop_pos towards pos_down
+    int pos = (pos_down < flow_stop_pos) ? flow_stop_pos - tilt
+                                         : flow_stop_pos + tilt;
+    int current_pos = servo.readMicroseconds();
+    pos = constrain(pos, current_pos - POUR_FLOW_MAX_STEP,
+                         current_pos + POUR_FLOW_MAX_STEP);
+    if (pos != current_pos) {
+        servo.writeMicroseconds(pos);
+        ads1231_note_motion();
+    }
+}
+
+/**
+ * Amount (centigrams) to pour at the trickle position in two phase mode (see
+ * POUR_MODE_TWO_PHASE in config.h).
+ */
+weight_t Bottle::get_trickle_mass(weight_t requested_amount)
+{
+    return min(requested_amount * (100 - fast_percent) / 100,
+               (weight_t)POUR_TRICKLE_MAX);
+}
+
+/**
+ * Move trickle_pos towards the position where the flow is POUR_TRICKLE_FLOW
+ * (centigrams per second). 'flow' is the flow measured at the trickle
+ * position. Stored in EEPROM.
+ */
+void Bottle::learn_trickle_pos(long flow)
+{
+    int step = 0;
+    if (flow > POUR_TRICKLE_FLOW * 3 / 2)
+        step = -POUR_TRICKLE_LEARN_STEP; // less tilt
+    else if (flow < POUR_TRICKLE_FLOW * 2 / 3)
+        step = POUR_TRICKLE_LEARN_STEP;  // more tilt
+    else
+        return;
+
+    // step is towards pos_down
+    if (pos_down < pos_up)
+        step = -step;
+    int min_pos = min(pos_down, get_pause_pos());
+    int max_pos = max(pos_down, get_pause_pos());
+    int pos = constrain(trickle_pos + step, min_pos, max_pos);
+    if (pos == trickle_pos)
+        return;
+    trickle_pos = pos;
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_TRICKLE_POS_EEPROM), trickle_pos);
+}
+
+/**
+ * Set the percentage of the requested amount which is poured at full tilt in
+ * two phase mode and store it in EEPROM.
+ */
+void Bottle::set_fast_percent(int percent)
+{
+    fast_percent = constrain(percent, 0, 100);
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_FAST_PERCENT_EEPROM), fast_percent);
+}
+
+/**
+ * Returns the tilt (microseconds) of servo position 'pos' beyond
+ * get_flow_stop_pos(), which includes the fill level. 0 if the bottle does
+ * not pour at 'pos'.
+ */
+long Bottle::get_flow_tilt(int pos)
+{
+    long tilt = (long)(pos - get_flow_stop_pos()) * ((pos_down < pos_up) ? -1 : 1);
+    return max(tilt, 0);
+}
+
+/**
+ * Returns the flow (centigrams per second) expected at servo position 'pos'
+ * or -1 if not learned yet (see learn_expected_flow()). The flow is assumed to
+ * be proportional to get_flow_tilt().
+ */
+long Bottle::get_expected_flow(int pos)
+{
+    if (flow_per_tilt < 0)
+        return -1;
+    return get_flow_tilt(pos) * flow_per_tilt / 100;
+}
+
+/**
+ * Returns the flow (centigrams per second) below which the bottle is
+ * considered empty at servo position 'pos'.
+ */
+long Bottle::get_empty_flow(int pos)
+{
+    long expected = get_expected_flow(pos);
+    if (expected >= 0)
+        return expected * EMPTY_FLOW_PERCENT / 100;
+    // Not learned yet: EMPTY_MIN_FLOW at pos_down, proportionally less at a
+    // shallower tilt (trickle position, flow control), which pours less.
+    long full_tilt = get_flow_tilt(pos_down);
+    if (full_tilt <= 0)
+        return EMPTY_MIN_FLOW;
+    return EMPTY_MIN_FLOW * min(get_flow_tilt(pos), full_tilt) / full_tilt;
+}
+
+/**
+ * Update flow_per_tilt with the settled 'flow' (centigrams per second)
+ * measured at the current servo position. Stored in EEPROM.
+ */
+void Bottle::learn_expected_flow(long flow)
+{
+    long tilt = get_flow_tilt(servo.readMicroseconds());
+    if (tilt < ONSET_MARGIN || flow < EMPTY_MIN_FLOW)
+        return; // not meaningful
+    long sample = flow * 100 / tilt;
+    if (flow_per_tilt < 0)
+        flow_per_tilt = sample;
+    else
+        flow_per_tilt += (sample - flow_per_tilt) >> EXPECTED_FLOW_LEARN_SHIFT;
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_FLOW_EEPROM), flow_per_tilt);
+}
+
+/**
+ * Pour a small amount (about pulse_mass): turn from pause position to the
+ * trickle position as fast as possible, wait TOPUP_PULSE_MILLIS and turn back.
+ * If the bottle is not at pause position, it is turned there first, so every
+ * pulse is the same movement (pulse_mass is learned for this movement).
+ * Returns 0 on success or an error code (e.g. WHERE_THE_FUCK_IS_THE_CUP).
+ */
+errv_t Bottle::pulse() {
+    RETURN_IFN_0(turn_to_pause_pos(TURN_DOWN_DELAY));
+    errv_t ret = turn_down_to(get_trickle_pos(), ONSET_JUMP_DELAY, true);
+    if (ret == 0)
+        ret = delay_abortable(TOPUP_PULSE_MILLIS);
+    // turn back in any case, we must not keep pouring
+    RETURN_IFN_0(turn_to_pause_pos(FAST_TURN_UP_DELAY));
+    return ret;
+}
+
+/**
+ * Returns true if 'amount' (centigrams) is small enough to be poured by
+ * pour_pulses() instead of a full pour cycle.
+ */
+bool Bottle::use_pulses(weight_t amount)
+{
+    return amount <= PULSE_POUR_MAX;
+}
+
+/**
+ * Pour a small amount by repeating pulse() until the weight is less than
+ * get_topup_tolerance() below 'target' (centigrams). The weight is measured
+ * stable after each pulse, pulse_mass is learned.
+ * Returns 0 on success, BOTTLE_EMPTY if a pulse brought (almost) nothing,
+ * WHERE_THE_FUCK_IS_THE_CUP or other errors (scale, ABORTED).
+ */
+errv_t Bottle::pour_pulses(weight_t target)
+{
+    weight_t weight;
+    RETURN_IFN_0(ads1231_get_weight(weight));
+    for (int i = 0; i < PULSE_POUR_MAX_PULSES && target - weight > get_topup_tolerance(); i++) {
+        weight_t before = weight;
+        RETURN_IFN_0(pulse());
+        RETURN_IFN_0(ads1231_get_stable_weight(weight));
+        if (weight < WEIGHT_EPSILON || weight < before - WEIGHT_EPSILON)
+            return WHERE_THE_FUCK_IS_THE_CUP;
+        if (weight - before < max(pulse_mass / 4, (weight_t)PULSE_EMPTY_MIN))
+            return BOTTLE_EMPTY;
+        learn_pulse_mass(weight - before);
+    }
+    return 0;
+}
+
+/**
+ * Missing amount (centigrams) which is tolerated without topping up. Less
+ * than half a pulse cannot be corrected.
+ */
+weight_t Bottle::get_topup_tolerance()
+{
+    return max(pulse_mass / 2, (weight_t)TOPUP_TOLERANCE);
+}
+
+/**
+ * Update pulse_mass with the 'mass' (centigrams) measured after pulse().
+ * Stored in EEPROM.
+ */
+void Bottle::learn_pulse_mass(weight_t mass)
+{
+    pulse_mass += (mass - pulse_mass) >> TOPUP_LEARN_SHIFT;
+    pulse_mass = constrain(pulse_mass, WEIGHT_EPSILON, GRAMS(MAX_POUR_ERROR) - 1);
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_PULSE_MASS_EEPROM), pulse_mass);
+}
+
+/**
+ * Update the drip model with a 'stable_weight' measured now, the first time
+ * after pour() only and not if more than ADS1231_STABLE_MILLIS passed since.
+ * Stored in EEPROM.
+ */
+void Bottle::learn_drip(weight_t stable_weight)
+{
+    if (!pause_millis)
+        return;
+    unsigned long elapsed = millis() - pause_millis;
+    pause_millis = 0;
+    // waited for something else meanwhile (cup, scale timeouts...)
+    if (elapsed > ADS1231_STABLE_MILLIS)
+        return;
+    weight_t mass = constrain(stable_weight - pause_weight, 0, GRAMS(MAX_POUR_ERROR) - 1);
+    // the weight was stable for ADS1231_STABLE_WINDOW already
+    int settle_millis = (int)max((long)elapsed - ADS1231_STABLE_WINDOW, 0L);
+
+    if (drip_millis < 0) {
+        drip_mass = mass;
+        drip_millis = settle_millis;
+    }
+    else {
+        drip_mass += (mass - drip_mass) >> DRIP_LEARN_SHIFT;
+        drip_millis += (settle_millis - drip_millis) >> DRIP_LEARN_SHIFT;
+    }
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_DRIP_MASS_EEPROM), drip_mass);
+    EEPROM_write(BOTTLE_EEPROM_POS(number, BOTTLE_DRIP_MILLIS_EEPROM), drip_millis);
+}
+
+/**
+ * Forget the weight of the last pour() without learning the drip from it,
+ * e.g. because the cup was replaced meanwhile.
+ */
+void Bottle::discard_drip()
+{
+    pause_millis = 0;
+}
+
+/**
+ * Check whether all drops of the last pour() arrived, does not block. Call
+ * with each new 'weight' (see ads1231_get_noblock()). If the weight is stable,
+ * sets 'settled' and returns it in 'settled_weight'.
+ * Returns 0 or a scale error.
+ */
+errv_t Bottle::poll_settled_weight(weight_t weight, weight_t& settled_weight, bool& settled)
+{
+    unsigned char confidence;
+    RETURN_IFN_0(ads1231_get_stability(weight, confidence));
+    if (confidence == 100) {
+        learn_drip(weight);
+        settled_weight = weight;
+        settled = true;
+    }
+    return 0;
+}
+
+/**
+ * Get the weight after all drops of the last pour() arrived: waits for a
+ * stable weight and updates the drip model with it. The drip model is not
+ * used to predict the weight, the result is used for accounting and learning.
+ * Returns 0 or a scale error.
+ */
+errv_t Bottle::get_settled_weight(weight_t& settled_weight)
+{
+    RETURN_IFN_0(ads1231_get_stable_weight(settled_weight));
+    learn_drip(settled_weight);
+    return 0;
+}
+
+/**
+ * Blocks while pouring until the weight plus the predicted cutoff mass (see
+ * get_cutoff_mass()) reaches 'target', i.e. until the bottle should be turned
+ * up. Gives up after POURING_TIMEOUT milliseconds. Depending on POUR_MODE
+ * the bottle is turned to control the flow meanwhile (see control_flow()),
+ * turned to trickle_pos when less than 'trickle_mass' is missing or stays where
+ * it is.
+ * Return values:   see also errors.h!
+ *  0 target weight will be reached (success)
+ *  DELAY_UNTIL_TIMEOUT timeout (pouring too slow)
+ *  BOTTLE_EMPTY no flow at start or flow much lower than expected
+ *  WHERE_THE_FUCK_IS_THE_CUP weight has decreased
+ *  other values: scale error (see ads1231.h) or ABORTED.
+ */
+errv_t Bottle::wait_poured(weight_t target, weight_t trickle_mass) {
+    unsigned long start = millis();
+    weight_t cur;
+    long flow;
+    weight_t last = GRAMS(-999); // == -inf, the first check always passes
+    bool established = false;    // flow was seen since start
+    unsigned long low_millis = 0;   // flow too low since, 0 if not
+    unsigned long tilt_millis = start; // bottle was tilted more last time
+    int last_pos = servo.readMicroseconds();
+    #if POUR_MODE == POUR_MODE_FLOW_CONTROL
+    // start at the current tilt, usually pos_down
+    long integral = (long)abs(servo.readMicroseconds() - get_flow_stop_pos())
+                    * POUR_FLOW_KI_DIV;
+    unsigned long control_millis = start;
+    #elif POUR_MODE == POUR_MODE_TWO_PHASE
+    unsigned long trickle_millis = 0; // 0 while not trickling
+    if (servo.readMicroseconds() == get_trickle_pos())
+        trickle_millis = start;
+    #endif
+
+    while(1) {
+        if(millis() - start > POURING_TIMEOUT)
+            return DELAY_UNTIL_TIMEOUT; // Timeout
+
+        // does not block, the sample is captured in the background
+        RETURN_IFN_0(ads1231_get_weight(cur));
+        RETURN_IFN_0(ads1231_get_flow(flow));
+
+        #ifdef POUR_TRACE_INTERVAL
+        IF_HAS_TIME_PASSED(POUR_TRACE_INTERVAL) {
+            unsigned long t = millis() - start;
+            DEBUG_START();
+            DEBUG_MSG("Trace: ");
+            DEBUG_VAL(t);
+            DEBUG_VAL(cur);
+            DEBUG_VAL(flow);
+            DEBUG_END();
+        }
+        #endif
+
+        RETURN_IFN_0(check_aborted());
+
+        // the flow lags behind when turning down
+        int pos = servo.readMicroseconds();
+        if ((pos_down < pos_up) ? pos < last_pos : pos > last_pos)
+            tilt_millis = millis();
+        last_pos = pos;
+        bool settled = millis() - tilt_millis > ADS1231_FLOW_WINDOW;
+
+        if(cur + get_cutoff_mass(flow) >= target) {
+            if (established && settled)
+                learn_expected_flow(flow);
+            #if POUR_MODE == POUR_MODE_TWO_PHASE
+            if (trickle_millis && millis() - trickle_millis > POUR_TRICKLE_LEARN_MILLIS)
+                learn_trickle_pos(flow);
+            #endif
+            return 0;
+        }
+
+        #if POUR_MODE == POUR_MODE_FLOW_CONTROL
+        if(millis() - control_millis >= POUR_FLOW_CONTROL_INTERVAL) {
+            control_millis = millis();
+            control_flow(target - cur, flow, integral);
+        }
+        #elif POUR_MODE == POUR_MODE_TWO_PHASE
+        if(!trickle_millis && cur + get_cutoff_mass(flow) >= target - trickle_mass) {
+            RETURN_IFN_0(turn_to(get_trickle_pos(), FAST_TURN_UP_DELAY, true));
+            trickle_millis = millis();
+        }
+        #endif
+
+        if(last > cur + WEIGHT_EPSILON || cur < WEIGHT_EPSILON)
+            return WHERE_THE_FUCK_IS_THE_CUP; // Current weight is smaller than last measured
+
+        // Bottle empty: no flow within BOTTLE_EMPTY_INTERVAL after start or
+        // too little flow for EMPTY_DETECT_MILLIS after it was established
+        if (!established) {
+            if (flow >= EMPTY_MIN_FLOW)
+                established = true;
+            else if (millis() - start > BOTTLE_EMPTY_INTERVAL)
+                return BOTTLE_EMPTY;
+        }
+        else if (settled && flow < get_empty_flow(pos)) {
+            if (!low_millis)
+                low_millis = millis();
+            else if (millis() - low_millis > EMPTY_DETECT_MILLIS)
+                return BOTTLE_EMPTY;
+        }
+        else {
+            low_millis = 0;
+        }
+
+        last = cur;
+    }
+}
+
+/**
+ * Pour requested_amount (in centigrams) from bottle..
+ * 'orig_weight' is the settled weight including ingredients poured until now
+ * (e.g. measured by crossfade()) or -1 if unknown, then it is measured here.
+ * Returns with the bottle at pause position, the drops are still falling.
+ * Call finish_pour() with the settled weight afterwards.
  * Return 0 on success, other values are return values of
- * delay_until (including scale error codes).
+ * wait_poured (including scale error codes).
  */
-errv_t Bottle::pour(int requested_amount, int& measured_amount) {
-    // orig_weight is weight including ingredients poured until now
-    int orig_weight = 0;
+errv_t Bottle::pour(weight_t requested_amount, weight_t& orig_weight) {
     int ret = 0;
     #ifndef WITHOUT_SCALE
-    while (1) {
-        // get weight while turning bottle, because ads1231_stable_millis()
+    ads1231_set_mode(ADS1231_SETTLING);
+
+    // Measured before, but is the cup still there?
+    if (orig_weight >= WEIGHT_EPSILON) {
+        weight_t weight;
+        RETURN_IFN_0(ads1231_get_weight(weight));
+        if (weight < orig_weight - WEIGHT_EPSILON)
+            orig_weight = -1;
+    }
+
+    while (orig_weight < WEIGHT_EPSILON) { // unknown or no cup
+        // get weight while turning bottle, because ads1231_get_stable_weight()
         // blocks bottle in pause position too long
         int below_pause = (pos_down + get_pause_pos()) / 2;
         ret = turn_to(below_pause, TURN_DOWN_DELAY, true, &orig_weight);
@@ -189,19 +906,16 @@ errv_t Bottle::pour(int requested_amount, int& measured_amount) {
         // removed while pouring (results in more alcohol). Stable weight
         // should resolve most problems.
         if (ret == WEIGHT_NOT_STABLE) {
-            ret = ads1231_get_stable_grams(orig_weight);
+            ret = ads1231_get_stable_weight(orig_weight);
         }
         if (ret != 0 && ret != WHERE_THE_FUCK_IS_THE_CUP) {
             return ret;
         }
         if (ret == WHERE_THE_FUCK_IS_THE_CUP || orig_weight < WEIGHT_EPSILON) {
             // no cup...
+            orig_weight = -1; // measure again
             RETURN_IFN_0(wait_for_cup());
         }
-        else {
-            // everything fine
-            break;
-        }
     }
     #endif
 
@@ -209,35 +923,68 @@ errv_t Bottle::pour(int requested_amount, int& measured_amount) {
     while(1) {
         // petres wants POURING message also after resume...
         // https://github.com/rfjakob/barwin-arduino/issues/10
-        MSG(String("POURING ") + String(number) + String(" ") + String(orig_weight));
+        String msg = String("POURING ") + String(number) + String(" ")
+                     + String(weight_to_grams(orig_weight));
+#ifdef SEND_CENTIGRAMS
+        msg += String(" ") + String(orig_weight);
+#endif
+        MSG(msg);
 
+        #ifndef WITHOUT_SCALE
+        // sample fast while the bottle is tilted, the sample period is the
+        // minimum time to react to the requested weight
+        ads1231_set_mode(ADS1231_POURING);
+        #endif
+
+        #ifndef WITHOUT_SCALE
+        if (use_pulses(requested_amount)) {
+            // small amount, no full pour cycle
+            ret = pour_pulses(orig_weight + requested_amount);
+        }
+        else {
+        #endif
         DEBUG_MSG_LN("Turn down");
+        #ifndef WITHOUT_SCALE
+        weight_t trickle_mass = 0;
+        #endif
+        #if POUR_MODE == POUR_MODE_TWO_PHASE && !defined(WITHOUT_SCALE)
+        trickle_mass = get_trickle_mass(requested_amount);
+        // nothing to pour at full tilt
+        if (trickle_mass >= requested_amount)
+            ret = turn_down_to(get_trickle_pos(), TURN_DOWN_DELAY, true);
+        else
+        #endif
         ret = turn_down(TURN_DOWN_DELAY, true); // enable check_weight
 
         // wait for requested weight
-        // FIXME here we do not want WEIGHT_EPSILON and sharp >
         if (ret == 0) {
             DEBUG_MSG_LN("Waiting");
             #ifndef WITHOUT_SCALE
-                ret = delay_until(POURING_TIMEOUT,
-                        orig_weight + requested_amount - UPGRIGHT_OFFSET, true);
+                ret = wait_poured(orig_weight + requested_amount, trickle_mass);
             #else
-                ret = delay_abortable(requested_amount * MS_PER_GRAMS);
+                ret = delay_abortable(weight_to_grams(requested_amount) * MS_PER_GRAMS);
             #endif
         }
+        #ifndef WITHOUT_SCALE
+        }
+        #endif
         if (ret == 0)
             break; // All good
 
         DEBUG_MSG_LN(String("pour: got err ") + String(ret));
 
+        #ifndef WITHOUT_SCALE
+        // waiting for resume or cup
+        ads1231_set_mode(ADS1231_IDLE);
+        #endif
+
         // Bottle empty
-        // Note that this does not work if requested_amount is less than
-        // UPGRIGHT_OFFSET!
         if(ret == BOTTLE_EMPTY) {
             ERROR(c_strerror(BOTTLE_EMPTY) + String(" ") + String(number) );
             // TODO other speed here? it is empty already!
             RETURN_IFN_0(turn_to(pos_up + BOTTLE_EMPTY_POS_OFFSET, TURN_UP_DELAY));
             RETURN_IFN_0(wait_for_resume()); // might return ABORTED
+            set_fill(GRAMS(BOTTLE_CAPACITY)); // refilled
 	    print_lcd("", 2);  // clear error (writing POUR command again would 
 	                       // be nicer, but difficult...)
         }
@@ -260,8 +1007,57 @@ errv_t Bottle::pour(int requested_amount, int& measured_amount) {
     RETURN_IFN_0(turn_to_pause_pos(TURN_UP_DELAY));
 
     #ifndef WITHOUT_SCALE
-    RETURN_IFN_0(ads1231_get_grams(measured_amount));
-    measured_amount -= orig_weight;
+    // the drops are weighed while crossfading, see get_settled_weight()
+    ads1231_set_mode(ADS1231_SETTLING);
+    RETURN_IFN_0(ads1231_get_weight(pause_weight));
+    pause_millis = millis();
+    if (use_pulses(requested_amount))
+        pause_millis = 0; // settled after each pulse, nothing to learn
+    #endif
+    return 0;
+}
+
+/**
+ * Account for the amount poured by pour(). 'orig_weight' is the weight before
+ * pouring as returned by pour(), 'settled_weight' the weight after all drops
+ * arrived or -1 if unknown, then it is measured here. Tops up if too little
+ * was poured, 'settled_weight' is updated then. 'next_bottle' (if not NULL)
+ * is turned up before topping up, so no other bottle is at pause position
+ * while pulsing. Returns the poured amount (centigrams) in 'measured_amount'.
+ * Return 0 on success or an error code.
+ */
+errv_t Bottle::finish_pour(weight_t requested_amount, weight_t orig_weight,
+                           weight_t& settled_weight, weight_t& measured_amount,
+                           Bottle* next_bottle) {
+    #ifndef WITHOUT_SCALE
+    ads1231_set_mode(ADS1231_SETTLING);
+    if (settled_weight < 0)
+        RETURN_IFN_0(get_settled_weight(settled_weight));
+    // cup removed while waiting? must not top up then
+    if (settled_weight < WEIGHT_EPSILON || settled_weight < orig_weight - WEIGHT_EPSILON)
+        return WHERE_THE_FUCK_IS_THE_CUP;
+    measured_amount = settled_weight - orig_weight;
+    if (!use_pulses(requested_amount))
+        learn_upright_offset(requested_amount, measured_amount);
+
+    // top up if too little was poured
+    if (next_bottle != NULL
+            && requested_amount - measured_amount > get_topup_tolerance())
+        RETURN_IFN_0(next_bottle->turn_up(TURN_UP_DELAY));
+    for (int i = 0; i < TOPUP_MAX_PULSES
+                    && requested_amount - measured_amount > get_topup_tolerance(); i++) {
+        weight_t before = measured_amount;
+        DEBUG_MSG_LN("Top up");
+        RETURN_IFN_0(pulse());
+        RETURN_IFN_0(ads1231_get_stable_weight(settled_weight));
+        measured_amount = settled_weight - orig_weight;
+        if (measured_amount - before < WEIGHT_EPSILON)
+            break; // nothing came out, probably empty
+        learn_pulse_mass(measured_amount - before);
+    }
+
+    if (fill >= 0)
+        set_fill(max(fill - measured_amount, 0));
     #else
     // this is not a real measurement, but best we can do not break the
     // protocol and keep everything backward compatible without scale...
@@ -272,6 +1068,10 @@ errv_t Bottle::pour(int requested_amount, int& measured_amount) {
     DEBUG_MSG("Stats: ");
     DEBUG_VAL(requested_amount);
     DEBUG_VAL(measured_amount);
+    DEBUG_VAL(upright_offset);
+    DEBUG_VAL(pulse_mass);
+    DEBUG_VAL(drip_mass);
+    DEBUG_VAL(drip_millis);
     DEBUG_END();
 
     return 0;
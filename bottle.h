@@ -15,6 +15,7 @@
 
 #include <Servo.h>
 #include "errors.h"
+#include "ads1231.h"
 
 // Macro initialising a array 'bottles' of Bottle instances as defined
 // in config.h by the comma separated list BOTTLES of constructor calls:
@@ -27,17 +28,70 @@ class Bottle {
     public:
         Bottle(unsigned char, unsigned char, int, int);
         static void init(Bottle* bottles, int bottles_nr);
-        errv_t turn_to(int pos, int delay_ms, bool check_weight=false, int* stable_weight=NULL, bool enable_abortcheck=true);
+        void read_eeprom();
+        errv_t turn_to(int pos, int delay_ms, bool check_weight=false, weight_t* stable_weight=NULL, bool enable_abortcheck=true);
         errv_t turn_up(int delay_ms, bool enable_abortcheck=true);
         errv_t turn_down(int delay_ms, bool check_weight=false);
+        errv_t turn_down_to(int pos, int delay_ms, bool check_weight=false);
+        errv_t calibrate_bottle_pos();
         int get_pause_pos();
+        int get_pause_travel();
+        long estimate_pour_millis(weight_t amount);
         errv_t turn_to_pause_pos(int delay_ms);
-        errv_t pour(int requested_amount, int& measured_amount);
+        errv_t pour(weight_t requested_amount, weight_t& orig_weight);
+        errv_t finish_pour(weight_t requested_amount, weight_t orig_weight,
+                           weight_t& settled_weight, weight_t& measured_amount,
+                           Bottle* next_bottle=NULL);
+        int get_flow_stop_pos();
+        int get_default_trickle_pos();
+        bool read_learned_trickle_pos(int& pos);
+        int get_tilt_compensation();
+        int get_onset_pos();
+        int get_trickle_pos();
+        void set_fill(weight_t fill);
+        bool is_low(weight_t requested_amount);
+        void set_density(int density);
+        weight_t ml_to_weight(long ml);
+        long weight_to_ml(weight_t weight);
+        long get_flow_tilt(int pos);
+        long get_expected_flow(int pos);
+        long get_empty_flow(int pos);
+        void learn_expected_flow(long flow);
+        errv_t pulse();
+        bool use_pulses(weight_t amount);
+        errv_t pour_pulses(weight_t target);
+        weight_t get_topup_tolerance();
+        void learn_pulse_mass(weight_t mass);
+        void learn_drip(weight_t stable_weight);
+        void discard_drip();
+        errv_t poll_settled_weight(weight_t weight, weight_t& settled_weight, bool& settled);
+        errv_t get_settled_weight(weight_t& settled_weight);
+        weight_t get_cutoff_mass(long flow);
+        errv_t wait_poured(weight_t target, weight_t trickle_mass=0);
+        void control_flow(weight_t remaining, long flow, long& integral);
+        weight_t get_trickle_mass(weight_t requested_amount);
+        void learn_trickle_pos(long flow);
+        void set_fast_percent(int percent);
+        void learn_upright_offset(weight_t requested_amount, weight_t measured_amount);
+        void set_upright_offset(weight_t offset);
         Servo servo;          // servo used for turning the bottle
         const unsigned char number;     // all bottles have a unique number (0-n)
         const unsigned char pin;       // pin to attach the servo
         const int pos_down;   // servo position for bottle down (pouring)
         const int pos_up;     // servo position for bottle up (not pouring)
+        weight_t upright_offset;  // learned correction of the cutoff (centigrams)
+        // onset_pos and trickle_pos are for a full bottle, see get_tilt_compensation()
+        int onset_pos;        // calibrated servo position where flow starts, -1 if unknown
+        int trickle_pos;      // learned servo position for the trickle phase
+        weight_t fill;        // liquid left in the bottle (centigrams), -1 if unknown
+        long flow_per_tilt;   // learned flow (cg/s) per 100us tilt, -1 if unknown
+        weight_t pulse_mass;  // learned mass poured by pulse() (centigrams)
+        weight_t drip_mass;   // learned mass dripping after pour() (centigrams)
+        int drip_millis;      // learned time until the drops arrived, -1 if unknown
+        weight_t pause_weight;       // weight when pour() returned
+        unsigned long pause_millis;  // time when pour() returned, 0 if learned
+        int fast_percent;     // percentage of amount poured before trickling
+        int density;          // density of the liquid (mg/ml)
 };
 
 #endif
@@ -10,6 +10,14 @@
 
 #define ADS1231_DATA_PIN 21
 #define ADS1231_CLK_PIN  20
+// HIGH selects 80 samples per second, LOW 10 samples per second
+#define ADS1231_SPEED_PIN 22
+// Hardware interrupt (INTn) of ADS1231_DATA_PIN, pin 21 is INT0 on the Mega
+#define ADS1231_DRDY_INT 0
+// Read the ADS1231 using direct port register access (see fastpin.h) instead
+// of digitalRead()/digitalWrite(). Disabled until the cycle counts of both
+// variants are measured (see README.md).
+//#define ADS1231_FAST_IO 1
 
 //#define WITHOUT_SCALE 1
 #define MS_PER_GRAMS  50.
@@ -75,8 +83,10 @@
                 Bottle(5,    7,   2300,    701), \
                 Bottle(6,    8,   2300,    600)
 
-// ADC counts per milligram
-#define ADS1231_DIVISOR  1565.1671343537414
+// ADC counts per gram (ADS1231_DIVISOR = 1565.1671343537414), multiplied by
+// 10^6 and rounded. An integer, because AVR has only 32 bit floats, which are
+// too inaccurate to compute the fixed point factor in ads1231.cpp.
+#define ADS1231_DIVISOR_E6  1565167134LL
 // Zero offset, grams
 //#define ADS1231_OFFSET   (127.97810572652163 - 3)
 // ADS1231_OFFSET will be stored in EPROM on command TARE!
@@ -88,47 +98,240 @@
 // raw2    = 761393.42307692312
 // weight2 = 679.2
 // ADS1231_DIVISOR = (raw1 - raw2) / (weight1 - weight2)
+// ADS1231_DIVISOR_E6 = round(ADS1231_DIVISOR * 10^6)
 // ADS1231_OFFSET  = weight1 - (raw1 * (weight1 - weight2)) / (raw1 - raw2)
 
+// Filter presets for scale samples, selected by ads1231_set_mode() (see
+// filter.h). Each stage can be disabled by setting its value to 1 (median_n,
+// average_n) or 0 (ema_shift). The window sizes must not exceed FILTER_MAX_N.
+// Keep POURING short, every sample of delay costs ~12.5ms reaction time.
+//                              median_n  average_n  ema_shift
+#define FILTER_PRESET_IDLE     {5,        4,         1}
+#define FILTER_PRESET_SETTLING {5,        8,         0}
+#define FILTER_PRESET_POURING  {3,        1,         0}
+
+// Moving servos cause spikes on the scale. Up to ADS1231_MOTION_HOLDOFF
+// milliseconds after a servo step, samples differing more than
+// ADS1231_MOTION_MAX_STEP centigrams from the last accepted sample are
+// dropped, but at most ADS1231_MOTION_MAX_REJECTS in a row (the change is
+// real then, e.g. the cup was removed).
+#define ADS1231_MOTION_HOLDOFF     150
+#define ADS1231_MOTION_MAX_STEP    300
+#define ADS1231_MOTION_MAX_REJECTS 3
+
 // Delay between single servo steps when turning bottle up/down, in milliseconds
 #define TURN_DOWN_DELAY        1
 #define TURN_UP_DELAY          2
 #define FAST_TURN_UP_DELAY     1  // used for abort and init
 #define CALIBRATION_TURN_DELAY 8  // used for calibrate_bottle_pos()
+#define ONSET_JUMP_DELAY       0  // used to turn down to the flow onset
 #define DANCING_DELAY          3  // used for DANCE
 
+// Fill level tracking: the liquid left in each bottle is decreased by every
+// pour and set to BOTTLE_CAPACITY (grams) on RESUME after BOTTLE_EMPTY or
+// BOTTLE_LOW (or set with REFILL). A cocktail is not started if less than
+// BOTTLE_LOW_RESERVE grams would be left in one of the bottles, ERROR
+// BOTTLE_LOW is sent instead and we wait for RESUME. An empty bottle needs
+// more tilt, the flow onset moves by up to ONSET_SHIFT_EMPTY microseconds
+// towards pos_down while the bottle empties.
+#define BOTTLE_CAPACITY     700
+#define BOTTLE_LOW_RESERVE  20
+#define ONSET_SHIFT_EMPTY   300
+
+// Density of the liquid in each bottle in mg/ml, used to convert volumes
+// (POUR_ML) to weights and back. DENSITY is used until set with SET_DENSITY,
+// values outside DENSITY_MIN..DENSITY_MAX are rejected.
+#define DENSITY             1000
+#define DENSITY_MIN         500
+#define DENSITY_MAX         2000
+
+// calibrate_bottle_pos(): the flow onset is where the weight increased by
+// CALIBRATION_ONSET_WEIGHT centigrams. When turning down, the bottle is turned
+// with ONSET_JUMP_DELAY until ONSET_MARGIN microseconds above the onset.
+#define CALIBRATION_ONSET_WEIGHT 100
+#define ONSET_MARGIN             40
+
 // Time to wait until cup is placed on scale (in seconds)
 #define CUP_TIMEOUT     180*1000
 
+// Automatic zero tracking while idle (see ads1231_auto_zero()), weights in
+// centigrams. Every AUTO_ZERO_INTERVAL milliseconds, a stable weight within
+// +/- AUTO_ZERO_WINDOW is moved by up to AUTO_ZERO_STEP towards zero, but no
+// more than AUTO_ZERO_MAX away from the last TARE. EEPROM is written if the
+// offset drifted more than AUTO_ZERO_SAVE.
+#define AUTO_ZERO_INTERVAL 1000
+#define AUTO_ZERO_WINDOW   100
+#define AUTO_ZERO_STEP     5
+#define AUTO_ZERO_MAX      500
+#define AUTO_ZERO_SAVE     50
+
+// Flow rate (see ads1231_get_flow()) is the slope of the weight within the
+// last ADS1231_FLOW_WINDOW milliseconds. Longer is less noisy but reacts
+// slower. Should be covered by ADS1231_HISTORY_SIZE samples at 80 samples
+// per second.
+#define ADS1231_FLOW_WINDOW 250
+
+// While pouring, print weight and flow rate every POUR_TRACE_INTERVAL
+// milliseconds as debug message. Only for debugging: at 9600 baud the trace
+// uses about half of the serial bandwidth and a full send buffer blocks right
+// where the cutoff timing matters.
+//#define POUR_TRACE_INTERVAL 100
+
 // Time to weight for a stable weight on scale
-// if ads1231_get_stable_grams() is called
+// if ads1231_get_stable_weight() is called
 #define ADS1231_STABLE_MILLIS 5000
 
+// The weight is stable if all samples within the last ADS1231_STABLE_WINDOW
+// milliseconds differ less than ADS1231_STABLE_EPSILON centigrams (see
+// ads1231_get_stability())
+#define ADS1231_STABLE_WINDOW  200
+#define ADS1231_STABLE_EPSILON 50
+
 // Milliseconds to wait until desired weight reached. If timeout is reached, probably
 // bottle is empty or screwed. This should never be reached because we should get a
 // BOTTLE_EMPTY error first. Only if something goes terribly wrong (unknown what)
 // this timeout will be reached.
 #define POURING_TIMEOUT  20000
 
-// Check if the bottle is empty (i.e. weight gain while pouring)
-// every x milliseconds
-#define BOTTLE_EMPTY_INTERVAL 1500
+// Empty bottle detection while pouring: the bottle is empty if the flow does
+// not reach EMPTY_MIN_FLOW (centigrams per second) within BOTTLE_EMPTY_INTERVAL
+// milliseconds after turning down, or if it is below EMPTY_FLOW_PERCENT of the
+// expected flow for EMPTY_DETECT_MILLIS afterwards. The expected flow at the
+// current tilt is learned per bottle at the end of each pour, weighting the
+// new value with 1/2^EXPECTED_FLOW_LEARN_SHIFT. Until learned, EMPTY_MIN_FLOW
+// is used instead, scaled down by the tilt at trickle or flow controlled
+// positions.
+#define BOTTLE_EMPTY_INTERVAL      1500
+#define EMPTY_MIN_FLOW             200
+#define EMPTY_FLOW_PERCENT         30
+#define EMPTY_DETECT_MILLIS        200
+#define EXPECTED_FLOW_LEARN_SHIFT  2
 
 // On BOTTE_EMPTY error, move the bottle to pos_up and add following value.
 // This turns the bottle a bit back and makes the error visible.
 // Note that pos_up + BOTTLE_EMPTY_POS_OFFSET must be < 2400!
 #define BOTTLE_EMPTY_POS_OFFSET -200
 
-// Stop pouring early in grams to account for the liquid pouring out while turning
-// the bottle up
-#define UPGRIGHT_OFFSET  22
+// Cutoff model, see Bottle::get_cutoff_mass(): the bottle is turned up when
+// the weight plus the predicted mass still reaching the cup is the requested
+// weight. Liquid keeps flowing at full rate for the latency of the scale
+// (sample period and filter delay) and while falling into the cup, then
+// decreases until the bottle is turned CUTOFF_TURN_PERCENT of the way from
+// pos_down to the pause position.
+#define SCALE_LATENCY_MILLIS  40
+#define FALL_MILLIS           100
+#define CUTOFF_TURN_PERCENT   50
+
+// Stop pouring early in centigrams, in addition to the cutoff model (which
+// accounts for most of the liquid pouring out while turning the bottle up)
+#define UPGRIGHT_OFFSET  500
+
+// The upright offset is learned for each bottle from the pour error (measured
+// minus requested amount) after each pour: the error is added with a weight of
+// 1/2^UPGRIGHT_OFFSET_LEARN_SHIFT and the result is limited to the range
+// UPGRIGHT_OFFSET_MIN..UPGRIGHT_OFFSET_MAX (centigrams). UPGRIGHT_OFFSET is the
+// initial value. Errors larger than MAX_POUR_ERROR are not learned.
+#define UPGRIGHT_OFFSET_LEARN_SHIFT  2
+#define UPGRIGHT_OFFSET_MIN  -1000
+#define UPGRIGHT_OFFSET_MAX  3000
 
-// When waiting for changes of weight on scale, ignore changes less than... (in grams)
-#define WEIGHT_EPSILON  2
+// How to pour, one of:
+//   POUR_MODE_FULL_TILT     stay at pos_down until the cutoff
+//   POUR_MODE_FLOW_CONTROL  closed loop flow control, see POUR_FLOW_*
+//   POUR_MODE_TWO_PHASE     full tilt, then trickle, see POUR_TRICKLE_*
+// The gains of POUR_MODE_FLOW_CONTROL are not tuned on hardware yet.
+#define POUR_MODE_FULL_TILT     0
+#define POUR_MODE_FLOW_CONTROL  1
+#define POUR_MODE_TWO_PHASE     2
+#define POUR_MODE  POUR_MODE_FULL_TILT
+
+// Pour order (see planner.h): bottles in POUR_LAST_BOTTLES are poured after
+// all other ingredients, bit i for bottle i, e.g. carbonated ingredients.
+// ESTIMATE_FLOW (centigrams per second) is used to estimate the time for
+// pouring until the flow of the bottle is learned.
+#define POUR_LAST_BOTTLES  0
+#define ESTIMATE_FLOW      2000
+
+// Drip model: drops keep falling after the bottle is back at pause position.
+// Their mass and the time until the weight is stable are learned per bottle
+// whenever a stable weight is measured after pouring (new values are weighted
+// with 1/2^DRIP_LEARN_SHIFT). The drip mass is added to the cutoff mass, the
+// drip time is used for the ETA (see planner.h). The poured amount is always
+// a measured stable weight, never predicted by the drip model.
+#define DRIP_LEARN_SHIFT  2
+
+// Top-up: if a bottle poured less than requested by more than its tolerance,
+// it is tilted to the trickle position for TOPUP_PULSE_MILLIS, at most
+// TOPUP_MAX_PULSES times. The mass of such a pulse is learned per bottle
+// (initially TOPUP_PULSE_MASS centigrams, new values are weighted with
+// 1/2^TOPUP_LEARN_SHIFT). The tolerance is half of it, but at least
+// TOPUP_TOLERANCE centigrams.
+#define TOPUP_PULSE_MILLIS  150
+#define TOPUP_MAX_PULSES    3
+#define TOPUP_PULSE_MASS    300
+#define TOPUP_TOLERANCE     100
+#define TOPUP_LEARN_SHIFT   1
+
+// Amounts up to PULSE_POUR_MAX centigrams are poured by repeating the top-up
+// pulse (at most PULSE_POUR_MAX_PULSES times) instead of turning the bottle
+// down and waiting for the cutoff.
+#define PULSE_POUR_MAX         1000
+#define PULSE_POUR_MAX_PULSES  10
+// The bottle is empty if a pulse brings less than a quarter of the learned
+// pulse mass, but at least PULSE_EMPTY_MIN centigrams (noise of the scale).
+#define PULSE_EMPTY_MIN        30
+
+// Closed loop flow control: while pouring, the servo is moved between
+// pos_down and Bottle::get_flow_stop_pos() by a PI controller to hold a target
+// flow. The target flow is the remaining amount poured within
+// POUR_FLOW_APPROACH_MILLIS, limited to POUR_FLOW_MIN..POUR_FLOW_MAX (in
+// centigrams per second), so we pour at full tilt first and slow down when
+// getting close. The servo position (microseconds of tilt) is the flow error
+// divided by POUR_FLOW_KP_DIV plus the integral of the flow error
+// (centigrams per second times milliseconds) divided by POUR_FLOW_KI_DIV. It
+// moves at most POUR_FLOW_MAX_STEP microseconds every
+// POUR_FLOW_CONTROL_INTERVAL milliseconds.
+// Untested starting values, tune them on the machine before enabling
+// POUR_MODE_FLOW_CONTROL.
+#define POUR_FLOW_APPROACH_MILLIS   800
+#define POUR_FLOW_MIN               300
+#define POUR_FLOW_MAX               10000
+#define POUR_FLOW_KP_DIV            20
+#define POUR_FLOW_KI_DIV            5000
+#define POUR_FLOW_MAX_STEP          20
+#define POUR_FLOW_CONTROL_INTERVAL  ADS1231_PERIOD_FAST
+
+// Two phase pouring: pour at full tilt, then turn back to the trickle position
+// of the bottle for the last part, which is (100 - fast percent) of the
+// requested amount but at most POUR_TRICKLE_MAX centigrams. The fast percent
+// is set per bottle with SET_TRICKLE (default POUR_FAST_PERCENT). The trickle
+// position is learned: if the flow at the cutoff is off by more than a factor
+// of 1.5 from POUR_TRICKLE_FLOW (centigrams per second), it is moved by
+// POUR_TRICKLE_LEARN_STEP microseconds. Only learned if the trickle phase
+// took at least POUR_TRICKLE_LEARN_MILLIS, so the flow was settled.
+#define POUR_FAST_PERCENT          80
+#define POUR_TRICKLE_MAX           500
+#define POUR_TRICKLE_FLOW          300
+#define POUR_TRICKLE_LEARN_STEP    5
+#define POUR_TRICKLE_LEARN_MILLIS  500
+
+// When waiting for changes of weight on scale, ignore changes less than...
+// (in centigrams)
+#define WEIGHT_EPSILON  150
+
+// crossfade() stops as soon as a single unfiltered sample is this much below
+// the weight of the cup (centigrams). Well above the servo spikes (see
+// ADS1231_MOTION_MAX_STEP), a removed cup drops the weight much more.
+#define CUP_REMOVED_RAW_DROP  1000
 
 // If ready, send READY message every x milliseconds
 #define SEND_READY_INTERVAL 2000
 
+// Append the weight in centigrams to READY and POURING messages (weights are
+// sent in grams otherwise). Changes the message format, enable it only if the
+// host understands the additional field.
+//#define SEND_CENTIGRAMS 1
+
 // Wait at least x milliseconds before calling ads1231_get_grams() again
 // when turning servo, because it takes to long to call it always. Increasing
 // this value makes the servo faster but the response time to the scale slower.
@@ -144,6 +347,10 @@
 // (not per bottle, but per pouring procedure)
 #define MAX_DRINK_GRAMS 250
 
+// Same as MAX_DRINK_GRAMS but for the volume (in milliliters), i.e. the
+// capacity of the glass. Converted with the density of each bottle.
+#define MAX_DRINK_ML    250
+
 // If the requested and the measured output for at least one ingredient is
 // larger, an ERROR message will be printed instead of ENJOY (in grams).
 #define MAX_POUR_ERROR  20
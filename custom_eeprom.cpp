@@ -11,7 +11,9 @@
 // long, ... as well. But does not work as expected. See commit 41062e26e70.
 
 /**
- * Write an int to EEPROM. Return how many bytes where written.
+ * Write an int to EEPROM. Return how many bytes where written. Cells which
+ * already hold the value are not written again (EEPROM.update()), learned
+ * values are saved after every pour.
  *
  * Stolen from:
  * http://playground.arduino.cc/Code/EEPROMWriteAnything
@@ -21,7 +23,7 @@ int EEPROM_write(int ee, const int& value)
     const byte* p = (const byte*)(const void*)&value;
     int i;
     for (i = 0; i < sizeof(value); i++)
-        EEPROM.write(ee++, *p++);
+        EEPROM.update(ee++, *p++);
     return i;
 }
 
@@ -41,3 +43,30 @@ int EEPROM_read(int ee, int& value)
     return i;
 }
 
+
+
+/**
+ * Write a long to EEPROM. Return how many bytes where written. Unchanged
+ * cells are not written, see above.
+ */
+int EEPROM_write(int ee, const long& value)
+{
+    const byte* p = (const byte*)(const void*)&value;
+    int i;
+    for (i = 0; i < sizeof(value); i++)
+        EEPROM.update(ee++, *p++);
+    return i;
+}
+
+
+/**
+ * Read a long from EEPROM. Return how many bytes where read.
+ */
+int EEPROM_read(int ee, long& value)
+{
+    byte* p = (byte*)(void*)&value;
+    int i;
+    for (i = 0; i < sizeof(value); i++)
+        *p++ = EEPROM.read(ee++);
+    return i;
+}
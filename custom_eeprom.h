@@ -11,7 +11,45 @@
 
 int EEPROM_read(int ee, int& value);
 int EEPROM_write(int ee, const int& value);
+int EEPROM_read(int ee, long& value);
+int EEPROM_write(int ee, const long& value);
 
-#define ADS1231_OFFSET_EEPROM_POS   0
+// Value read from EEPROM cells which were never written
+#define EEPROM_ERASED_LONG  ((long)0xFFFFFFFF)
+
+// Tare offset in grams (int), replaced by ADS1231_OFFSET_EEPROM_POS and only
+// read if the latter was never written.
+#define ADS1231_OFFSET_GRAMS_EEPROM_POS  0
+// Tare offset in centigrams (long)
+#define ADS1231_OFFSET_EEPROM_POS        2
+
+// Per bottle values: a block of BOTTLE_EEPROM_SIZE bytes for each bottle,
+// starting at BOTTLES_EEPROM_POS. Use BOTTLE_EEPROM_POS() with one of the
+// BOTTLE_*_EEPROM field offsets below to get the address.
+#define BOTTLES_EEPROM_POS               16
+#define BOTTLE_EEPROM_SIZE               32
+#define BOTTLE_EEPROM_POS(nr, field)     (BOTTLES_EEPROM_POS \
+                                          + (nr) * BOTTLE_EEPROM_SIZE + (field))
+
+// Learned upright offset in centigrams (long)
+#define BOTTLE_UPGRIGHT_OFFSET_EEPROM    0
+// Two phase pouring: learned trickle position in microseconds (int) and
+// percentage of the requested amount poured at full tilt (int)
+#define BOTTLE_TRICKLE_POS_EEPROM        4
+#define BOTTLE_FAST_PERCENT_EEPROM       6
+// Calibrated servo position where liquid starts to flow (int)
+#define BOTTLE_ONSET_POS_EEPROM          8
+// Liquid left in the bottle in centigrams, -1 if unknown (long)
+#define BOTTLE_FILL_EEPROM               10
+// Learned flow in centigrams per second per 100 microseconds tilt (long)
+#define BOTTLE_FLOW_EEPROM               14
+// Learned mass of a top-up pulse in centigrams (long)
+#define BOTTLE_PULSE_MASS_EEPROM         18
+// Learned drip model: mass in centigrams (long) and time in milliseconds until
+// the weight is stable after pouring (int)
+#define BOTTLE_DRIP_MASS_EEPROM          22
+#define BOTTLE_DRIP_MILLIS_EEPROM        26
+// Density of the liquid in mg/ml (int)
+#define BOTTLE_DENSITY_EEPROM            28
 
 #endif
@@ -33,6 +33,9 @@ String c_strerror(errv_t errno)
         case        MAX_DRINK_GRAMS_EXCEEDED:
             return "MAX_EXCEEDED";
 
+        case        MAX_DRINK_ML_EXCEEDED:
+            return "MAX_ML_EXCEEDED";
+
         case        INVALID_COMMAND:
             return "INVAL_CMD";
 
@@ -42,6 +45,9 @@ String c_strerror(errv_t errno)
         case        POURING_INACCURATE:
             return "INACCURATE";
 
+        case        BOTTLE_LOW:
+            return "BOTTLE_LOW";
+
         case        ADS1231_TIMEOUT_HIGH:
             return "ADS_TO_H";
 
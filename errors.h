@@ -35,6 +35,8 @@ String c_strerror(errv_t errno);
 #define RESUMED                      16    // after BOTTLE_EMPTY
 #define WEIGHT_NOT_STABLE            17    // if turn_to() reaches pos before weight stable
 #define POURING_INACCURATE         18    // requested and measured amount differ too much
+#define BOTTLE_LOW                   19    // not enough left in bottle for cocktail
+#define MAX_DRINK_ML_EXCEEDED        20    // volume of ingredients exceeds MAX_DRINK_ML
 
 // Serial message parsing
 #define INVALID_COMMAND              21
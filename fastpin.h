@@ -0,0 +1,69 @@
+/**
+ * Compile time specialized access to digital pins.
+ *
+ * digitalRead() and digitalWrite() look up port and bit of the pin in tables
+ * in flash on every call, which costs dozens of cycles. FastPin<pin> resolves
+ * them at compile time, so read() and write() boil down to a single
+ * instruction. Pins without a specialization below (and all pins on other
+ * boards) fall back to ArduinoPin<pin>, i.e. digitalRead()/digitalWrite().
+ *
+ * Note: write() is only atomic for ports A-G, ports H-L are not reachable
+ * with sbi/cbi and need a read-modify-write. Use such pins only if no
+ * interrupt handler writes the same port.
+ *
+ * The speedup has not been measured yet (unverified, see README.md).
+ */
+
+#ifndef FASTPIN_H
+#define FASTPIN_H
+
+#include <Arduino.h>
+
+template<uint8_t pin> struct ArduinoPin {
+    static inline uint8_t read() { return digitalRead(pin); }
+    static inline void write(uint8_t val) { digitalWrite(pin, val); }
+};
+
+template<uint8_t pin> struct FastPin : ArduinoPin<pin> {};
+
+#define FASTPIN(pin, port, bit_nr) \
+    template<> struct FastPin<pin> { \
+        static inline uint8_t read() { return (PIN##port >> bit_nr) & 1; } \
+        static inline void write(uint8_t val) { \
+            if (val) \
+                PORT##port |= bit(bit_nr); \
+            else \
+                PORT##port &= ~bit(bit_nr); \
+        } \
+    }
+
+#if defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1280__)
+// Digital pins 0-21 of the Mega, see
+// https://www.arduino.cc/en/Hacking/PinMapping2560
+FASTPIN( 0, E, 0);
+FASTPIN( 1, E, 1);
+FASTPIN( 2, E, 4);
+FASTPIN( 3, E, 5);
+FASTPIN( 4, G, 5);
+FASTPIN( 5, E, 3);
+FASTPIN( 6, H, 3);
+FASTPIN( 7, H, 4);
+FASTPIN( 8, H, 5);
+FASTPIN( 9, H, 6);
+FASTPIN(10, B, 4);
+FASTPIN(11, B, 5);
+FASTPIN(12, B, 6);
+FASTPIN(13, B, 7);
+FASTPIN(14, J, 1);
+FASTPIN(15, J, 0);
+FASTPIN(16, H, 1);
+FASTPIN(17, H, 0);
+FASTPIN(18, D, 3);
+FASTPIN(19, D, 2);
+FASTPIN(20, D, 1);
+FASTPIN(21, D, 0);
+#endif
+
+#undef FASTPIN
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * Integer filter chain for scale samples, see filter.h.
+ */
+
+#include <Arduino.h>
+
+#include "filter.h"
+
+/*
+ * Set the parameters and reset the filter as if 'weight' had been measured
+ * forever. Used to change parameters without a jump in the output.
+ * Window sizes are limited to 1..FILTER_MAX_N.
+ */
+void filter_init(filter& f, const filter_params& params, weight_t weight)
+{
+    f.params = params;
+    f.params.median_n = constrain(params.median_n, 1, FILTER_MAX_N);
+    f.params.average_n = constrain(params.average_n, 1, FILTER_MAX_N);
+
+    for (unsigned char i = 0; i < FILTER_MAX_N; i++) {
+        f.median_buf[i] = weight;
+        f.average_buf[i] = weight;
+    }
+    f.average_sum = weight * f.params.average_n;
+    f.pos = 0;
+    f.ema = weight * (1L << f.params.ema_shift);
+    f.gate_last = weight;
+    f.gate_rejects = 0;
+}
+
+/*
+ * Rate of change gate, call it before filter_process(). Returns false if
+ * 'weight' differs more than max_step from the last accepted sample, i.e. the
+ * sample should be dropped. After max_rejects dropped samples in a row the
+ * change is considered real and the sample is accepted. max_step = 0 accepts
+ * everything.
+ */
+bool filter_gate(filter& f, weight_t weight, weight_t max_step,
+                 unsigned char max_rejects)
+{
+    if (max_step > 0 && abs(weight - f.gate_last) > max_step
+            && f.gate_rejects < max_rejects) {
+        f.gate_rejects++;
+        return false;
+    }
+    f.gate_last = weight;
+    f.gate_rejects = 0;
+    return true;
+}
+
+/*
+ * Median of the last n values in buf. Sorts a copy, n is small.
+ */
+static weight_t filter_median(const weight_t* buf, unsigned char n)
+{
+    weight_t sorted[FILTER_MAX_N];
+    for (unsigned char i = 0; i < n; i++) {
+        // insertion sort
+        weight_t val = buf[i];
+        unsigned char j = i;
+        for (; j > 0 && sorted[j - 1] > val; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = val;
+    }
+    return sorted[n / 2];
+}
+
+/*
+ * Feed a sample into the filter and return the filtered weight.
+ */
+weight_t filter_process(filter& f, weight_t weight)
+{
+    // The buffers are rings of size median_n and average_n. f.pos wraps at
+    // a common multiple of both sizes, so one counter serves both rings.
+    unsigned char median_pos = f.pos % f.params.median_n;
+    unsigned char average_pos = f.pos % f.params.average_n;
+    f.pos = (f.pos + 1) % (f.params.median_n * f.params.average_n);
+
+    f.median_buf[median_pos] = weight;
+    weight = filter_median(f.median_buf, f.params.median_n);
+
+    f.average_sum += weight - f.average_buf[average_pos];
+    f.average_buf[average_pos] = weight;
+    weight = f.average_sum / f.params.average_n;
+
+    f.ema += weight - (f.ema >> f.params.ema_shift);
+    return f.ema >> f.params.ema_shift;
+}
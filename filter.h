@@ -0,0 +1,40 @@
+/**
+ * Integer filter chain for scale samples.
+ *
+ * Each sample passes a rate of change gate (filter_gate()), a median filter,
+ * a moving average and exponential smoothing, in this order. Every stage can
+ * be turned off by its parameter (see filter_params). No dynamic memory, all
+ * buffers have FILTER_MAX_N entries.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "ads1231.h"
+
+// Maximum window size of the median filter and the moving average
+#define FILTER_MAX_N 8
+
+struct filter_params {
+    unsigned char median_n;     // median of last median_n samples, 1 = off
+    unsigned char average_n;    // average of last average_n medians, 1 = off
+    unsigned char ema_shift;    // y += (x - y) / 2^ema_shift, 0 = off
+};
+
+struct filter {
+    filter_params params;
+    weight_t median_buf[FILTER_MAX_N];
+    weight_t average_buf[FILTER_MAX_N];
+    long average_sum;
+    unsigned char pos;          // next position in median_buf and average_buf
+    long ema;                   // output of the last stage times 2^ema_shift
+    weight_t gate_last;         // last sample accepted by filter_gate()
+    unsigned char gate_rejects; // samples rejected since then
+};
+
+void filter_init(filter& f, const filter_params& params, weight_t weight);
+bool filter_gate(filter& f, weight_t weight, weight_t max_step,
+                 unsigned char max_rejects);
+weight_t filter_process(filter& f, weight_t weight);
+
+#endif
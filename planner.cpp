@@ -0,0 +1,147 @@
+/**
+ * Pour order planner, see planner.h.
+ */
+
+#include <Arduino.h>
+
+#include "planner.h"
+#include "config.h"
+
+struct planner_state {
+    Bottle* bottles;
+    char* candidates;       // bottle numbers to pour
+    int nr;                 // size of candidates
+    unsigned int last_mask; // candidates (bit i for candidates[i]) to pour last
+    char cur[PLANNER_MAX_BOTTLES];  // order searched currently (candidate indices)
+    char best[PLANNER_MAX_BOTTLES];
+    long best_millis;
+};
+
+/*
+ * Time to turn the first bottle from up to pause position.
+ */
+static long planner_first_millis(Bottle& b)
+{
+    return (long)b.get_pause_travel() * TURN_DOWN_DELAY;
+}
+
+/*
+ * Time for crossfade() from bottle 'from' to bottle 'to' until the weight of
+ * 'from' is settled.
+ */
+static long planner_transition_millis(Bottle& from, Bottle& to)
+{
+    long millis = (long)max(from.get_pause_travel(), to.get_pause_travel())
+                  * TURN_UP_DELAY;
+    return max(millis, (long)from.drip_millis);
+}
+
+/*
+ * Time to turn the last bottle from pause position up.
+ */
+static long planner_last_millis(Bottle& b)
+{
+    return (long)b.get_pause_travel() * TURN_UP_DELAY;
+}
+
+/*
+ * Depth first search over all orders, 'depth' candidates are placed in
+ * s.cur already ('used' as bit mask) which takes 'millis'.
+ */
+static void planner_search(planner_state& s, int depth, unsigned int used, long millis)
+{
+    // bound: all times are positive, cannot get better than best
+    if (millis >= s.best_millis)
+        return;
+
+    if (depth == s.nr) {
+        millis += planner_last_millis(s.bottles[(int)s.candidates[(int)s.cur[depth - 1]]]);
+        if (millis < s.best_millis) {
+            s.best_millis = millis;
+            memcpy(s.best, s.cur, s.nr);
+        }
+        return;
+    }
+
+    unsigned int all = (1u << s.nr) - 1;
+    bool others_left = (all & ~used & ~s.last_mask) != 0;
+    for (int i = 0; i < s.nr; i++) {
+        unsigned int bit = 1u << i;
+        if ((used & bit) || (others_left && (s.last_mask & bit)))
+            continue;
+
+        Bottle& b = s.bottles[(int)s.candidates[i]];
+        long step;
+        if (depth == 0)
+            step = planner_first_millis(b);
+        else
+            step = planner_transition_millis(
+                        s.bottles[(int)s.candidates[(int)s.cur[depth - 1]]], b);
+        s.cur[depth] = i;
+        planner_search(s, depth + 1, used | bit, millis + step);
+    }
+}
+
+/*
+ * Estimate the time (milliseconds) to pour the bottles in 'order' (size
+ * 'order_nr', 'requested_amount' in centigrams per bottle as for
+ * plan_cocktail()).
+ * If 'at_pause' is set, the first bottle is at pause position already.
+ */
+long estimate_cocktail_millis(Bottle* bottles, weight_t* requested_amount,
+                              char* order, int order_nr, bool at_pause)
+{
+    long millis = 0;
+    for (int i = 0; i < order_nr; i++) {
+        Bottle& b = bottles[(int)order[i]];
+        if (i > 0)
+            millis += planner_transition_millis(bottles[(int)order[i - 1]], b);
+        else if (!at_pause)
+            millis += planner_first_millis(b);
+        millis += b.estimate_pour_millis(requested_amount[(int)order[i]]);
+    }
+    if (order_nr > 0)
+        millis += planner_last_millis(bottles[(int)order[order_nr - 1]]);
+    return millis;
+}
+
+/*
+ * Find the fastest order to pour a cocktail. 'requested_amount' (in
+ * centigrams, see pour_cocktail()) has one entry per bottle, bottles with 0
+ * are left out.
+ * The bottle numbers are written to 'order' (size bottles_nr), their count to
+ * 'order_nr'.
+ * Returns the estimated time for the whole cocktail in milliseconds, including
+ * pouring (see Bottle::estimate_pour_millis()).
+ */
+long plan_cocktail(Bottle* bottles, int bottles_nr, weight_t* requested_amount,
+                   char* order, int& order_nr)
+{
+    planner_state s;
+    char candidates[PLANNER_MAX_BOTTLES];
+    long pour_millis = 0;
+
+    s.bottles = bottles;
+    s.candidates = candidates;
+    s.nr = 0;
+    s.last_mask = 0;
+    for (int i = 0; i < bottles_nr && s.nr < PLANNER_MAX_BOTTLES; i++) {
+        if (requested_amount[i] == 0)
+            continue;
+        if (POUR_LAST_BOTTLES & (1ul << i))
+            s.last_mask |= 1u << s.nr;
+        pour_millis += bottles[i].estimate_pour_millis(requested_amount[i]);
+        candidates[s.nr++] = i;
+    }
+
+    order_nr = s.nr;
+    if (s.nr == 0)
+        return 0;
+
+    s.best_millis = 0x7FFFFFFF;
+    planner_search(s, 0, 0, 0);
+
+    for (int i = 0; i < s.nr; i++)
+        order[i] = candidates[(int)s.best[i]];
+    return s.best_millis + pour_millis;
+}
@@ -0,0 +1,25 @@
+/**
+ * Pour order planner.
+ *
+ * Each bottle has its own servo, so the order of the ingredients only changes
+ * the transitions: crossfade() turns the last bottle up while the next one
+ * turns down to pause position, which takes as long as the longer of both
+ * movements (or the drip time of the last bottle, if longer). The planner
+ * searches all orders (branch and bound) for the shortest total time.
+ * Bottles in POUR_LAST_BOTTLES (see config.h) are poured after all others.
+ */
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "bottle.h"
+
+// The planner uses bit masks, this is the maximum number of bottles
+#define PLANNER_MAX_BOTTLES 16
+
+long plan_cocktail(Bottle* bottles, int bottles_nr, weight_t* requested_amount,
+                   char* order, int& order_nr);
+long estimate_cocktail_millis(Bottle* bottles, weight_t* requested_amount,
+                              char* order, int order_nr, bool at_pause=false);
+
+#endif
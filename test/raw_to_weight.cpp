@@ -0,0 +1,56 @@
+/**
+ * Host test for ads1231_raw_to_weight(): sweeps all 24 bit raw values for a
+ * few offsets and compares the fixed point conversion to the exact result
+ * (integer division, truncated towards zero). The fixed point conversion has
+ * to be at least as accurate as the float division it replaced, which is
+ * evaluated with 32 bit floats like on AVR.
+ *
+ * Build and run with "make test" in the top directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+class String;  // Arduino class, only used in declarations of errors.h
+#include "../ads1231.h"
+
+static long exact_weight(long raw, weight_t offset)
+{
+    // 100 * raw / (ADS1231_DIVISOR_E6 / 10^6) + offset
+    return (100000000LL * raw + (long long)offset * ADS1231_DIVISOR_E6)
+           / ADS1231_DIVISOR_E6;
+}
+
+static long float_weight(long raw, weight_t offset)
+{
+    const float divisor = ADS1231_DIVISOR_E6 / 1e6;
+    return (long)(100.0f * (float)raw / divisor + (float)offset);
+}
+
+int main()
+{
+    const weight_t offsets[] = {0, GRAMS(128), -GRAMS(128), 1, -1, -12797};
+    long fixed_errors = 0, float_errors = 0, max_error = 0;
+
+    for (unsigned i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        for (long raw = -(1L << 23); raw < (1L << 23); raw++) {
+            long exact = exact_weight(raw, offsets[i]);
+            long error = ads1231_raw_to_weight(raw, offsets[i]) - exact;
+            if (error != 0)
+                fixed_errors++;
+            if (error > max_error || -error > max_error)
+                max_error = error > 0 ? error : -error;
+            if (float_weight(raw, offsets[i]) != exact)
+                float_errors++;
+        }
+    }
+
+    printf("raw_to_weight: fixed point wrong %ld times (max %ld cg), "
+           "float wrong %ld times\n", fixed_errors, max_error, float_errors);
+    if (max_error > 1 || fixed_errors > float_errors) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
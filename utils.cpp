@@ -4,6 +4,7 @@
 #include "bottle.h"
 #include "errors.h"
 #include "config.h"
+#include "ads1231.h"
 
 /**
  * Used to call something every 'time_period' milliseconds.
@@ -158,9 +159,17 @@ errv_t delay_abortable(long max_delay) {
  *           / \
  * b1 ______/   \______ pause position
  *
- * Returns ABORTED if aborted.
+ * If 'settled_weight' is not NULL (i.e. while pouring), the weight after all
+ * drops of bottle 1 arrived is measured meanwhile as soon as it is stable, or
+ * after the movement if it did not get stable before (see
+ * Bottle::get_settled_weight(), -1 without scale). The cup is watched too:
+ * if the weight drops (checked on the unfiltered samples, see
+ * CUP_REMOVED_RAW_DROP, and on the filtered weight), the bottles stop and
+ * WHERE_THE_FUCK_IS_THE_CUP is returned. Calling crossfade() again continues.
+ *
+ * Returns ABORTED if aborted or scale errors.
  */
-errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
+errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms, weight_t* settled_weight) {
     int step = 1;
     int b1_pos = b1->servo.readMicroseconds();
     int b2_pos = b2->servo.readMicroseconds();
@@ -169,6 +178,10 @@ errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
     int b1_step = b1_pos < b1->pos_up ? 1 : -1;
     int b2_step = b2_pos >= b2->get_pause_pos() ? 1 : -1;
     bool done_something;
+    #ifndef WITHOUT_SCALE
+    bool settled = false;
+    weight_t cup_weight = 0; // highest weight while crossfading
+    #endif
 
     DEBUG_MSG_LN("crossfade " + String(b1->number) + String(" ") + String(b2->number));
 
@@ -179,6 +192,7 @@ errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
         b1_pos += b1_step;
         if(b1_step * b1_pos < b1_step * b1->pos_up) {
             b1->servo.writeMicroseconds(b1_pos);
+            ads1231_note_motion();
             done_something=true;
         }
 
@@ -188,6 +202,7 @@ errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
         b2_pos -= b2_step;
         if(b2_step * b2_pos > b2_step * b2->get_pause_pos()) {
             b2->servo.writeMicroseconds(b2_pos);
+            ads1231_note_motion();
             done_something=true;
         }
 
@@ -195,6 +210,36 @@ errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
         if(done_something==false)
             break;
 
+        #ifndef WITHOUT_SCALE
+        // watch the cup and weigh the drops of bottle 1 meanwhile
+        if (settled_weight) {
+            // The filtered weight lags several samples behind (motion gate,
+            // median, average), check the newest raw sample first to stop
+            // within one sample period.
+            ads1231_sample sample;
+            RETURN_IFN_0(ads1231_get_sample(sample));
+            weight_t raw_weight = ads1231_raw_to_weight(sample.raw, ads1231_offset);
+            if (raw_weight < WEIGHT_EPSILON
+                    || (cup_weight && raw_weight < cup_weight - CUP_REMOVED_RAW_DROP))
+                return WHERE_THE_FUCK_IS_THE_CUP;
+
+            weight_t weight;
+            errv_t ret = ads1231_get_noblock(weight);
+            if (ret == 0) {
+                // Stop where we are, bottles between up and pause position
+                // do not pour.
+                if (weight < WEIGHT_EPSILON || weight < cup_weight - WEIGHT_EPSILON)
+                    return WHERE_THE_FUCK_IS_THE_CUP;
+                cup_weight = max(cup_weight, weight);
+                if (!settled)
+                    RETURN_IFN_0(b1->poll_settled_weight(weight, *settled_weight, settled));
+            }
+            else if (ret != ADS1231_WOULD_BLOCK) {
+                return ret;
+            }
+        }
+        #endif
+
         delay(delay_ms/2);
 
         if (check_aborted()) {
@@ -205,5 +250,13 @@ errv_t crossfade(Bottle * b1, Bottle * b2, int delay_ms) {
         }
     }
 
+    #ifndef WITHOUT_SCALE
+    if (settled_weight && !settled)
+        RETURN_IFN_0(b1->get_settled_weight(*settled_weight));
+    #else
+    if (settled_weight)
+        *settled_weight = -1;
+    #endif
+
     return 0;
 }
@@ -73,7 +73,7 @@ bool is_button_pressed(int pin);
 bool is_button_pressed(int pin1, int pin2);
 errv_t check_aborted(bool receive_resume=false);
 errv_t delay_abortable(long max_delay);
-errv_t  crossfade(Bottle * b1, Bottle * b2, int delay_ms);
+errv_t  crossfade(Bottle * b1, Bottle * b2, int delay_ms, weight_t* settled_weight=NULL);
 
 /**
  * A quite dangerous macro, to simplify usage of has_time_passed().